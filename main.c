@@ -5,12 +5,22 @@
 #define _BSD_SOURCE
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #ifdef __APPLE__
@@ -19,6 +29,10 @@
 #include <termio.h>
 #endif
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <time.h>
 #include <unistd.h>
 
@@ -26,6 +40,19 @@
 
 #define NI_VERSION "0.0.1"
 #define NI_TAB_STOP 4
+#define NI_MACRO_REGS 26 // Macro registers a-z
+#define NI_MACRO_DEPTH 16 // Max nesting of @ inside a macro
+#define NI_RENDER_BUDGET (64 * 1024 * 1024) // Render cache bytes kept across buffers
+#define NI_BUFFER_IDLE 30 // Seconds hidden before a buffer's render cache may be dropped
+#define NI_GAP_MIN 64 // Initial gap when a row is opened for editing
+#define NI_MAX_FPS 60 // Default frame rate cap, 0 for no cap
+#define NI_FRAME_MAX_DELAY 250 // Milliseconds a frame may be skipped for pending input
+#define NI_IDLE_TIMEOUT 100 // Milliseconds without input before deferred work runs
+#define NI_WRAP_CHUNK (64 * 1024) // Bytes of rows laid out between checks for input when idle
+#define NI_SEARCH_MAX_THREADS 16 // Worker threads for :grep and :find
+#define NI_SEARCH_MAX_RESULTS 10000 // A search stops after this many results
+#define NI_SEARCH_MAX_LINE 200 // Bytes of a matching line kept in a :grep result
+#define NI_SEARCH_CHUNK (1024 * 1024) // Bytes of a file searched between checks for cancellation
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -48,34 +75,54 @@ enum editorModes {
     COMMAND_MODE,
 };
 
+enum bufferKinds {
+    FILE_BUFFER,
+    GREP_BUFFER, // :grep results, one path:line: text per row
+    FIND_BUFFER, // :find results, one path per row
+};
+
 /*** dynamic string type ***/
 typedef struct {
     char *b; // Heap allocated buffer
     int len; // string length
+    int cap; // allocated size
 } abuf;
 
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
 
 /*** dynamic string methods ***/
 void abAppend(abuf *ab, const char *s, int len) {
-    char *new = realloc(ab->b, ab->len + len);
-
-    if (new == NULL) return;
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
+    if (ab->len + len > ab->cap) {
+        // Grow geometrically so appends are amortized O(1)
+        int cap = ab->cap ? ab->cap : 64;
+        while (cap < ab->len + len) cap *= 2;
+
+        char *new = realloc(ab->b, cap);
+        if (new == NULL) return;
+        ab->b = new;
+        ab->cap = cap;
+    }
+    memcpy(&ab->b[ab->len], s, len);
     ab->len += len;
 }
 
+void abReset(abuf *ab) {
+    // Empty the string, keeps the memory for reuse
+    ab->len = 0;
+}
+
 void abDelete(abuf *ab, size_t n) {
     // Reduce len, does not reallocate memory
-    if (ab->len - n > 0) {
+    if ((size_t) ab->len >= n) {
         ab->len -= n;
     }
 }
 
 void abFree(abuf *ab) {
     ab->len = 0;
+    ab->cap = 0;
     free(ab->b);
+    ab->b = NULL;
 }
 
 /*** data ***/
@@ -83,37 +130,153 @@ void abFree(abuf *ab) {
 typedef struct {
     int size;
     int rsize;
+    int rcols; // Display columns of render
+    int ascii; // Row is pure ASCII, so bytes and columns line up
+    int wide; // Row has clusters two columns wide, lines can break early before them
+    int wlines; // Screen lines taken in wrap mode, cached for the buffer's wrapcols
     char *chars;
     char *render;
 } erow;
 
-struct editorConfig {
-    enum editorModes mode; // Editor mode
-    abuf cmdbuf; // Command buffer for command mode and others
-    int cmdrep; // Movement repetition
+typedef struct {
+    int *keys; // Recorded key codes
+    int len;
+    int cap;
+} macro;
+
+typedef struct {
+    int reg; // Register being replayed
+    int pos; // Next key to feed
+    int len; // Keys to replay, fixed when the replay starts
+} macroReplay;
 
+typedef struct {
     int cx, cy; // Cursor coord in files
     int rx; // Cursor x rendered with tabs
     int rowoff; // Row offset for scroll
+    int rowoffsub; // Screen lines of row rowoff scrolled off the top in wrap mode
     int coloff; // Column offset
-    int screenrows; // Screen dimensions
-    int screencols;
 
     int numrows; // No. rows in buffer
+    int rowcap; // Allocated rows
     erow *row; // dynamically allocated line array of the buffer
 
-    char *filename; // file in current editor buffer
+    char *filename; // file in the buffer
+    enum bufferKinds kind; // What the rows are
+    time_t lastshown; // Last time the buffer was current
+
+    int *wraptree; // Fenwick tree of row wlines for wrap mode
+    int wrapcap; // Allocated tree nodes
+    int wrapn; // Rows in the tree, -1 when rows were inserted or deleted since
+    int wrapcols; // Screen width the tree and wlines are for
+    int wrapscan; // Rows from the top whose wlines are known
+} ebuf;
+
+typedef struct {
+    int line; // Screen line within the row
+    int lx; // Column within that line
+    int at; // Display column within the row
+} wrapPos;
+
+typedef struct {
+    int row; // Row of the current buffer being edited, -1 if none
+    int gap, gapend, cap; // Gap in chars and its allocated size
+    int rgap, rgapend, rcap; // Gap in render and its allocated size
+    int rx; // Display column at the gap
+    int tabp; // Bytes from the gap to the next tab, -1 if none, -2 if not scanned yet
+    int tabcols; // Display columns of those bytes
+    int tabw; // Display width of that tab
+    int tabr; // Bytes of render it takes, its width when it was laid out
+    int join; // Columns the cluster after the gap loses by continuing the one before it
+    int *wrapline; // Logical byte and display column of each screen line start after the first, in wrap mode
+    int wrapn; // Line starts known, a prefix of the row's lines
+    int wrapcap; // Allocated line starts
+    int wrapcols; // Screen width the line starts are for
+} gapRow;
+
+struct editorConfig {
+    enum editorModes mode; // Editor mode
+    abuf cmdbuf; // Command buffer for command mode and others
+    int cmdrep; // Movement repetition
+
+    int screenrows; // Screen dimensions
+    int screencols;
+    volatile sig_atomic_t resized; // Set by SIGWINCH, handled by the input loop
+    sigset_t waitmask; // Signal mask while waiting for input, SIGWINCH let through
+    int wrap; // Soft wrap long rows instead of scrolling horizontally
+
+    abuf frame; // Output buffer reused by every frame
+    int framepending; // Screen is out of date
+    struct timespec lastframe; // When the last frame was written
+    int maxfps; // Frame rate cap, 0 for none
+    int sync; // Wrap frames in synchronized update mode
+
+    ebuf *buf; // Current buffer
+    ebuf **buffers; // All open buffers
+    int numbufs;
+    size_t renderbytes; // Render cache bytes held by all buffers
+    gapRow gap; // Row being typed into in insert mode
+    struct search *search; // Running :grep or :find, NULL if none
+
     char statusmsg[80]; // Status
     time_t statusmsg_time;
 
+    macro macros[NI_MACRO_REGS]; // Macro registers
+    int recording; // Register being recorded into, -1 if none
+    int lastmacro; // Last replayed register for @@, -1 if none
+    macroReplay replay[NI_MACRO_DEPTH]; // Stack of macros being replayed
+    int replaydepth;
+
     struct termios orig_termios; // Original terminal attributes
 };
 
 struct editorConfig E;
 
+/*** macros ***/
+
+/*
+ * Map a register name to its index, -1 if it isn't a valid register
+ */
+int editorMacroReg(int c) {
+    if (c >= 'a' && c <= 'z') return c - 'a';
+    return -1;
+}
+
+void editorMacroAppend(macro *m, int key) {
+    if (m->len == m->cap) {
+        int cap = m->cap ? m->cap * 2 : 64;
+        int *new = realloc(m->keys, sizeof(int) * cap);
+
+        if (new == NULL) return;
+        m->keys = new;
+        m->cap = cap;
+    }
+    m->keys[m->len++] = key;
+}
+
+/*
+ * Feed the next key of the innermost replaying macro.
+ * The register is looked up on every key since recording into the same
+ * register may realloc it while it is being replayed.
+ */
+int editorMacroNextKey() {
+    macroReplay *r = &E.replay[E.replaydepth - 1];
+
+    // A command left waiting for input at the end of the macro gets
+    // cancelled instead of blocking on the terminal
+    if (r->pos >= r->len) return '\x1b';
+    return E.macros[r->reg].keys[r->pos++];
+}
+
 /*** terminal ***/
 
 void editorClearScreen();
+void editorHandleResize();
+void editorIdle();
+void editorFlushFrame();
+void editorSearchPoll();
+int editorWaitInput(long ms);
+void editorSetStatusMsg(const char *fmt, ...);
 
 /*
  * Errorhandling.
@@ -183,13 +346,29 @@ void enableRawMode() {
 }
 
 /*
- * Reads a key press and return the char
+ * Reads a key press from the terminal and return the char
  */
-int editorReadKey() {
+int editorReadTermKey() {
     int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) die("read");
+    unsigned char c;
+    while (1) {
+        // Stream in results of a running search
+        editorSearchPoll();
+
+        // Any number of SIGWINCH since the last wakeup is handled once
+        if (E.resized) editorHandleResize();
+
+        // Draw the screen unless more input is already waiting
+        editorFlushFrame();
+
+        // Woken up by a key, a resize, search results or the idle timeout
+        int ready = editorWaitInput(NI_IDLE_TIMEOUT);
+        if (ready == 0) editorIdle();
+        if (ready != 1) continue;
+
+        nread = read(STDIN_FILENO, &c, 1);
+        if (nread == 1) break;
+        if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
     }
 
     // Process escape sequences
@@ -232,6 +411,18 @@ int editorReadKey() {
     return c;
 }
 
+/*
+ * Reads the next key, either from a replaying macro or the terminal.
+ * Keys typed while recording are appended to the recorded register.
+ */
+int editorReadKey() {
+    if (E.replaydepth > 0) return editorMacroNextKey();
+
+    int c = editorReadTermKey();
+    if (E.recording >= 0) editorMacroAppend(&E.macros[E.recording], c);
+    return c;
+}
+
 int getCursorPosition(int *rows, int *cols) {
     char buf[32];
     unsigned int i = 0;
@@ -279,100 +470,2074 @@ int getWindowSize(int *rows, int *cols) {
     }
 }
 
-/*** row operations ***/
+/*** unicode ***/
+
+typedef struct {
+    uint32_t lo, hi;
+} urange;
+
+/*
+ * Code point ranges from the Unicode 14.0.0 character database, general
+ * categories from UnicodeData.txt and widths from EastAsianWidth.txt.
+ * Moving to a newer Unicode version means recomputing them by these rules.
+ * Zero width: general categories Mn, Me and Cf (except U+00AD),
+ * Hangul medial vowels U+1160..U+11FF and U+200B.
+ * Wide: East Asian Width W or F, excluding zero width and unassigned
+ * code points outside planes 2 and 3.
+ */
+const urange zeroWidthTable[] = {
+    {0x00300, 0x0036F}, {0x00483, 0x00489}, {0x00591, 0x005BD}, {0x005BF, 0x005BF},
+    {0x005C1, 0x005C2}, {0x005C4, 0x005C5}, {0x005C7, 0x005C7}, {0x00600, 0x00605},
+    {0x00610, 0x0061A}, {0x0061C, 0x0061C}, {0x0064B, 0x0065F}, {0x00670, 0x00670},
+    {0x006D6, 0x006DD}, {0x006DF, 0x006E4}, {0x006E7, 0x006E8}, {0x006EA, 0x006ED},
+    {0x0070F, 0x0070F}, {0x00711, 0x00711}, {0x00730, 0x0074A}, {0x007A6, 0x007B0},
+    {0x007EB, 0x007F3}, {0x007FD, 0x007FD}, {0x00816, 0x00819}, {0x0081B, 0x00823},
+    {0x00825, 0x00827}, {0x00829, 0x0082D}, {0x00859, 0x0085B}, {0x00890, 0x00891},
+    {0x00898, 0x0089F}, {0x008CA, 0x00902}, {0x0093A, 0x0093A}, {0x0093C, 0x0093C},
+    {0x00941, 0x00948}, {0x0094D, 0x0094D}, {0x00951, 0x00957}, {0x00962, 0x00963},
+    {0x00981, 0x00981}, {0x009BC, 0x009BC}, {0x009C1, 0x009C4}, {0x009CD, 0x009CD},
+    {0x009E2, 0x009E3}, {0x009FE, 0x009FE}, {0x00A01, 0x00A02}, {0x00A3C, 0x00A3C},
+    {0x00A41, 0x00A42}, {0x00A47, 0x00A48}, {0x00A4B, 0x00A4D}, {0x00A51, 0x00A51},
+    {0x00A70, 0x00A71}, {0x00A75, 0x00A75}, {0x00A81, 0x00A82}, {0x00ABC, 0x00ABC},
+    {0x00AC1, 0x00AC5}, {0x00AC7, 0x00AC8}, {0x00ACD, 0x00ACD}, {0x00AE2, 0x00AE3},
+    {0x00AFA, 0x00AFF}, {0x00B01, 0x00B01}, {0x00B3C, 0x00B3C}, {0x00B3F, 0x00B3F},
+    {0x00B41, 0x00B44}, {0x00B4D, 0x00B4D}, {0x00B55, 0x00B56}, {0x00B62, 0x00B63},
+    {0x00B82, 0x00B82}, {0x00BC0, 0x00BC0}, {0x00BCD, 0x00BCD}, {0x00C00, 0x00C00},
+    {0x00C04, 0x00C04}, {0x00C3C, 0x00C3C}, {0x00C3E, 0x00C40}, {0x00C46, 0x00C48},
+    {0x00C4A, 0x00C4D}, {0x00C55, 0x00C56}, {0x00C62, 0x00C63}, {0x00C81, 0x00C81},
+    {0x00CBC, 0x00CBC}, {0x00CBF, 0x00CBF}, {0x00CC6, 0x00CC6}, {0x00CCC, 0x00CCD},
+    {0x00CE2, 0x00CE3}, {0x00D00, 0x00D01}, {0x00D3B, 0x00D3C}, {0x00D41, 0x00D44},
+    {0x00D4D, 0x00D4D}, {0x00D62, 0x00D63}, {0x00D81, 0x00D81}, {0x00DCA, 0x00DCA},
+    {0x00DD2, 0x00DD4}, {0x00DD6, 0x00DD6}, {0x00E31, 0x00E31}, {0x00E34, 0x00E3A},
+    {0x00E47, 0x00E4E}, {0x00EB1, 0x00EB1}, {0x00EB4, 0x00EBC}, {0x00EC8, 0x00ECD},
+    {0x00F18, 0x00F19}, {0x00F35, 0x00F35}, {0x00F37, 0x00F37}, {0x00F39, 0x00F39},
+    {0x00F71, 0x00F7E}, {0x00F80, 0x00F84}, {0x00F86, 0x00F87}, {0x00F8D, 0x00F97},
+    {0x00F99, 0x00FBC}, {0x00FC6, 0x00FC6}, {0x0102D, 0x01030}, {0x01032, 0x01037},
+    {0x01039, 0x0103A}, {0x0103D, 0x0103E}, {0x01058, 0x01059}, {0x0105E, 0x01060},
+    {0x01071, 0x01074}, {0x01082, 0x01082}, {0x01085, 0x01086}, {0x0108D, 0x0108D},
+    {0x0109D, 0x0109D}, {0x01160, 0x011FF}, {0x0135D, 0x0135F}, {0x01712, 0x01714},
+    {0x01732, 0x01733}, {0x01752, 0x01753}, {0x01772, 0x01773}, {0x017B4, 0x017B5},
+    {0x017B7, 0x017BD}, {0x017C6, 0x017C6}, {0x017C9, 0x017D3}, {0x017DD, 0x017DD},
+    {0x0180B, 0x0180F}, {0x01885, 0x01886}, {0x018A9, 0x018A9}, {0x01920, 0x01922},
+    {0x01927, 0x01928}, {0x01932, 0x01932}, {0x01939, 0x0193B}, {0x01A17, 0x01A18},
+    {0x01A1B, 0x01A1B}, {0x01A56, 0x01A56}, {0x01A58, 0x01A5E}, {0x01A60, 0x01A60},
+    {0x01A62, 0x01A62}, {0x01A65, 0x01A6C}, {0x01A73, 0x01A7C}, {0x01A7F, 0x01A7F},
+    {0x01AB0, 0x01ACE}, {0x01B00, 0x01B03}, {0x01B34, 0x01B34}, {0x01B36, 0x01B3A},
+    {0x01B3C, 0x01B3C}, {0x01B42, 0x01B42}, {0x01B6B, 0x01B73}, {0x01B80, 0x01B81},
+    {0x01BA2, 0x01BA5}, {0x01BA8, 0x01BA9}, {0x01BAB, 0x01BAD}, {0x01BE6, 0x01BE6},
+    {0x01BE8, 0x01BE9}, {0x01BED, 0x01BED}, {0x01BEF, 0x01BF1}, {0x01C2C, 0x01C33},
+    {0x01C36, 0x01C37}, {0x01CD0, 0x01CD2}, {0x01CD4, 0x01CE0}, {0x01CE2, 0x01CE8},
+    {0x01CED, 0x01CED}, {0x01CF4, 0x01CF4}, {0x01CF8, 0x01CF9}, {0x01DC0, 0x01DFF},
+    {0x0200B, 0x0200F}, {0x0202A, 0x0202E}, {0x02060, 0x02064}, {0x02066, 0x0206F},
+    {0x020D0, 0x020F0}, {0x02CEF, 0x02CF1}, {0x02D7F, 0x02D7F}, {0x02DE0, 0x02DFF},
+    {0x0302A, 0x0302D}, {0x03099, 0x0309A}, {0x0A66F, 0x0A672}, {0x0A674, 0x0A67D},
+    {0x0A69E, 0x0A69F}, {0x0A6F0, 0x0A6F1}, {0x0A802, 0x0A802}, {0x0A806, 0x0A806},
+    {0x0A80B, 0x0A80B}, {0x0A825, 0x0A826}, {0x0A82C, 0x0A82C}, {0x0A8C4, 0x0A8C5},
+    {0x0A8E0, 0x0A8F1}, {0x0A8FF, 0x0A8FF}, {0x0A926, 0x0A92D}, {0x0A947, 0x0A951},
+    {0x0A980, 0x0A982}, {0x0A9B3, 0x0A9B3}, {0x0A9B6, 0x0A9B9}, {0x0A9BC, 0x0A9BD},
+    {0x0A9E5, 0x0A9E5}, {0x0AA29, 0x0AA2E}, {0x0AA31, 0x0AA32}, {0x0AA35, 0x0AA36},
+    {0x0AA43, 0x0AA43}, {0x0AA4C, 0x0AA4C}, {0x0AA7C, 0x0AA7C}, {0x0AAB0, 0x0AAB0},
+    {0x0AAB2, 0x0AAB4}, {0x0AAB7, 0x0AAB8}, {0x0AABE, 0x0AABF}, {0x0AAC1, 0x0AAC1},
+    {0x0AAEC, 0x0AAED}, {0x0AAF6, 0x0AAF6}, {0x0ABE5, 0x0ABE5}, {0x0ABE8, 0x0ABE8},
+    {0x0ABED, 0x0ABED}, {0x0FB1E, 0x0FB1E}, {0x0FE00, 0x0FE0F}, {0x0FE20, 0x0FE2F},
+    {0x0FEFF, 0x0FEFF}, {0x0FFF9, 0x0FFFB}, {0x101FD, 0x101FD}, {0x102E0, 0x102E0},
+    {0x10376, 0x1037A}, {0x10A01, 0x10A03}, {0x10A05, 0x10A06}, {0x10A0C, 0x10A0F},
+    {0x10A38, 0x10A3A}, {0x10A3F, 0x10A3F}, {0x10AE5, 0x10AE6}, {0x10D24, 0x10D27},
+    {0x10EAB, 0x10EAC}, {0x10F46, 0x10F50}, {0x10F82, 0x10F85}, {0x11001, 0x11001},
+    {0x11038, 0x11046}, {0x11070, 0x11070}, {0x11073, 0x11074}, {0x1107F, 0x11081},
+    {0x110B3, 0x110B6}, {0x110B9, 0x110BA}, {0x110BD, 0x110BD}, {0x110C2, 0x110C2},
+    {0x110CD, 0x110CD}, {0x11100, 0x11102}, {0x11127, 0x1112B}, {0x1112D, 0x11134},
+    {0x11173, 0x11173}, {0x11180, 0x11181}, {0x111B6, 0x111BE}, {0x111C9, 0x111CC},
+    {0x111CF, 0x111CF}, {0x1122F, 0x11231}, {0x11234, 0x11234}, {0x11236, 0x11237},
+    {0x1123E, 0x1123E}, {0x112DF, 0x112DF}, {0x112E3, 0x112EA}, {0x11300, 0x11301},
+    {0x1133B, 0x1133C}, {0x11340, 0x11340}, {0x11366, 0x1136C}, {0x11370, 0x11374},
+    {0x11438, 0x1143F}, {0x11442, 0x11444}, {0x11446, 0x11446}, {0x1145E, 0x1145E},
+    {0x114B3, 0x114B8}, {0x114BA, 0x114BA}, {0x114BF, 0x114C0}, {0x114C2, 0x114C3},
+    {0x115B2, 0x115B5}, {0x115BC, 0x115BD}, {0x115BF, 0x115C0}, {0x115DC, 0x115DD},
+    {0x11633, 0x1163A}, {0x1163D, 0x1163D}, {0x1163F, 0x11640}, {0x116AB, 0x116AB},
+    {0x116AD, 0x116AD}, {0x116B0, 0x116B5}, {0x116B7, 0x116B7}, {0x1171D, 0x1171F},
+    {0x11722, 0x11725}, {0x11727, 0x1172B}, {0x1182F, 0x11837}, {0x11839, 0x1183A},
+    {0x1193B, 0x1193C}, {0x1193E, 0x1193E}, {0x11943, 0x11943}, {0x119D4, 0x119D7},
+    {0x119DA, 0x119DB}, {0x119E0, 0x119E0}, {0x11A01, 0x11A0A}, {0x11A33, 0x11A38},
+    {0x11A3B, 0x11A3E}, {0x11A47, 0x11A47}, {0x11A51, 0x11A56}, {0x11A59, 0x11A5B},
+    {0x11A8A, 0x11A96}, {0x11A98, 0x11A99}, {0x11C30, 0x11C36}, {0x11C38, 0x11C3D},
+    {0x11C3F, 0x11C3F}, {0x11C92, 0x11CA7}, {0x11CAA, 0x11CB0}, {0x11CB2, 0x11CB3},
+    {0x11CB5, 0x11CB6}, {0x11D31, 0x11D36}, {0x11D3A, 0x11D3A}, {0x11D3C, 0x11D3D},
+    {0x11D3F, 0x11D45}, {0x11D47, 0x11D47}, {0x11D90, 0x11D91}, {0x11D95, 0x11D95},
+    {0x11D97, 0x11D97}, {0x11EF3, 0x11EF4}, {0x13430, 0x13438}, {0x16AF0, 0x16AF4},
+    {0x16B30, 0x16B36}, {0x16F4F, 0x16F4F}, {0x16F8F, 0x16F92}, {0x16FE4, 0x16FE4},
+    {0x1BC9D, 0x1BC9E}, {0x1BCA0, 0x1BCA3}, {0x1CF00, 0x1CF2D}, {0x1CF30, 0x1CF46},
+    {0x1D167, 0x1D169}, {0x1D173, 0x1D182}, {0x1D185, 0x1D18B}, {0x1D1AA, 0x1D1AD},
+    {0x1D242, 0x1D244}, {0x1DA00, 0x1DA36}, {0x1DA3B, 0x1DA6C}, {0x1DA75, 0x1DA75},
+    {0x1DA84, 0x1DA84}, {0x1DA9B, 0x1DA9F}, {0x1DAA1, 0x1DAAF}, {0x1E000, 0x1E006},
+    {0x1E008, 0x1E018}, {0x1E01B, 0x1E021}, {0x1E023, 0x1E024}, {0x1E026, 0x1E02A},
+    {0x1E130, 0x1E136}, {0x1E2AE, 0x1E2AE}, {0x1E2EC, 0x1E2EF}, {0x1E8D0, 0x1E8D6},
+    {0x1E944, 0x1E94A}, {0xE0001, 0xE0001}, {0xE0020, 0xE007F}, {0xE0100, 0xE01EF},
+};
+
+const urange wideTable[] = {
+    {0x01100, 0x0115F}, {0x0231A, 0x0231B}, {0x02329, 0x0232A}, {0x023E9, 0x023EC},
+    {0x023F0, 0x023F0}, {0x023F3, 0x023F3}, {0x025FD, 0x025FE}, {0x02614, 0x02615},
+    {0x02648, 0x02653}, {0x0267F, 0x0267F}, {0x02693, 0x02693}, {0x026A1, 0x026A1},
+    {0x026AA, 0x026AB}, {0x026BD, 0x026BE}, {0x026C4, 0x026C5}, {0x026CE, 0x026CE},
+    {0x026D4, 0x026D4}, {0x026EA, 0x026EA}, {0x026F2, 0x026F3}, {0x026F5, 0x026F5},
+    {0x026FA, 0x026FA}, {0x026FD, 0x026FD}, {0x02705, 0x02705}, {0x0270A, 0x0270B},
+    {0x02728, 0x02728}, {0x0274C, 0x0274C}, {0x0274E, 0x0274E}, {0x02753, 0x02755},
+    {0x02757, 0x02757}, {0x02795, 0x02797}, {0x027B0, 0x027B0}, {0x027BF, 0x027BF},
+    {0x02B1B, 0x02B1C}, {0x02B50, 0x02B50}, {0x02B55, 0x02B55}, {0x02E80, 0x02E99},
+    {0x02E9B, 0x02EF3}, {0x02F00, 0x02FD5}, {0x02FF0, 0x02FFB}, {0x03000, 0x03029},
+    {0x0302E, 0x0303E}, {0x03041, 0x03096}, {0x0309B, 0x030FF}, {0x03105, 0x0312F},
+    {0x03131, 0x0318E}, {0x03190, 0x031E3}, {0x031F0, 0x0321E}, {0x03220, 0x03247},
+    {0x03250, 0x04DBF}, {0x04E00, 0x0A48C}, {0x0A490, 0x0A4C6}, {0x0A960, 0x0A97C},
+    {0x0AC00, 0x0D7A3}, {0x0F900, 0x0FA6D}, {0x0FA70, 0x0FAD9}, {0x0FE10, 0x0FE19},
+    {0x0FE30, 0x0FE52}, {0x0FE54, 0x0FE66}, {0x0FE68, 0x0FE6B}, {0x0FF01, 0x0FF60},
+    {0x0FFE0, 0x0FFE6}, {0x16FE0, 0x16FE3}, {0x16FF0, 0x16FF1}, {0x17000, 0x187F7},
+    {0x18800, 0x18CD5}, {0x18D00, 0x18D08}, {0x1AFF0, 0x1AFF3}, {0x1AFF5, 0x1AFFB},
+    {0x1AFFD, 0x1AFFE}, {0x1B000, 0x1B122}, {0x1B150, 0x1B152}, {0x1B164, 0x1B167},
+    {0x1B170, 0x1B2FB}, {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E},
+    {0x1F191, 0x1F19A}, {0x1F200, 0x1F202}, {0x1F210, 0x1F23B}, {0x1F240, 0x1F248},
+    {0x1F250, 0x1F251}, {0x1F260, 0x1F265}, {0x1F300, 0x1F320}, {0x1F32D, 0x1F335},
+    {0x1F337, 0x1F37C}, {0x1F37E, 0x1F393}, {0x1F3A0, 0x1F3CA}, {0x1F3CF, 0x1F3D3},
+    {0x1F3E0, 0x1F3F0}, {0x1F3F4, 0x1F3F4}, {0x1F3F8, 0x1F43E}, {0x1F440, 0x1F440},
+    {0x1F442, 0x1F4FC}, {0x1F4FF, 0x1F53D}, {0x1F54B, 0x1F54E}, {0x1F550, 0x1F567},
+    {0x1F57A, 0x1F57A}, {0x1F595, 0x1F596}, {0x1F5A4, 0x1F5A4}, {0x1F5FB, 0x1F64F},
+    {0x1F680, 0x1F6C5}, {0x1F6CC, 0x1F6CC}, {0x1F6D0, 0x1F6D2}, {0x1F6D5, 0x1F6D7},
+    {0x1F6DD, 0x1F6DF}, {0x1F6EB, 0x1F6EC}, {0x1F6F4, 0x1F6FC}, {0x1F7E0, 0x1F7EB},
+    {0x1F7F0, 0x1F7F0}, {0x1F90C, 0x1F93A}, {0x1F93C, 0x1F945}, {0x1F947, 0x1F9FF},
+    {0x1FA70, 0x1FA74}, {0x1FA78, 0x1FA7C}, {0x1FA80, 0x1FA86}, {0x1FA90, 0x1FAAC},
+    {0x1FAB0, 0x1FABA}, {0x1FAC0, 0x1FAC5}, {0x1FAD0, 0x1FAD9}, {0x1FAE0, 0x1FAE7},
+    {0x1FAF0, 0x1FAF6}, {0x20000, 0x3FFFD},
+};
+
+int editorInTable(uint32_t cp, const urange *table, int n) {
+    int lo = 0, hi = n - 1;
+    if (cp < table[0].lo || cp > table[hi].hi) return 0;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (cp > table[mid].hi) {
+            lo = mid + 1;
+        } else if (cp < table[mid].lo) {
+            hi = mid - 1;
+        } else {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Display width of a code point in terminal columns
+ */
+int editorCharWidth(uint32_t cp) {
+    if (cp < 0x80) return 1;
+    if (editorInTable(cp, zeroWidthTable, sizeof(zeroWidthTable) / sizeof(urange))) return 0;
+    if (editorInTable(cp, wideTable, sizeof(wideTable) / sizeof(urange))) return 2;
+    return 1;
+}
+
+/*
+ * Check whether a string is pure ASCII, 16 bytes at a time with SSE2
+ * and 8 at a time otherwise
+ */
+int editorIsAscii(const char *s, int len) {
+    int j = 0;
+#ifdef __SSE2__
+    for (; j + 16 <= len; j += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (s + j));
+        if (_mm_movemask_epi8(v)) return 0;
+    }
+#endif
+    for (; j + 8 <= len; j += 8) {
+        uint64_t w;
+        memcpy(&w, s + j, 8);
+        if (w & 0x8080808080808080ULL) return 0;
+    }
+    for (; j < len; ++j) {
+        if (s[j] & 0x80) return 0;
+    }
+    return 1;
+}
+
+/*
+ * Decode the UTF-8 sequence at s into cp and return its length in bytes.
+ * Invalid or truncated sequences decode as U+FFFD one byte at a time.
+ */
+int editorDecodeUTF8(const char *s, int len, uint32_t *cp) {
+    const unsigned char *u = (const unsigned char *) s;
+    int n, j;
+
+    if (u[0] < 0x80) {
+        *cp = u[0];
+        return 1;
+    } else if ((u[0] & 0xe0) == 0xc0) {
+        n = 2;
+        *cp = u[0] & 0x1f;
+    } else if ((u[0] & 0xf0) == 0xe0) {
+        n = 3;
+        *cp = u[0] & 0x0f;
+    } else if ((u[0] & 0xf8) == 0xf0) {
+        n = 4;
+        *cp = u[0] & 0x07;
+    } else {
+        *cp = 0xfffd;
+        return 1;
+    }
+
+    if (n > len) {
+        *cp = 0xfffd;
+        return 1;
+    }
+    for (j = 1; j < n; ++j) {
+        if ((u[j] & 0xc0) != 0x80) {
+            *cp = 0xfffd;
+            return 1;
+        }
+        *cp = (*cp << 6) | (u[j] & 0x3f);
+    }
+    return n;
+}
+
+int editorIsRegionalIndicator(uint32_t cp) {
+    return cp >= 0x1f1e6 && cp <= 0x1f1ff;
+}
+
+/*
+ * Whether cp continues the grapheme cluster that prev ended with:
+ * combining marks and other zero width code points, whatever follows a
+ * zero width joiner, emoji skin tone modifiers and the second half of a
+ * regional indicator flag pair. Control characters like tabs are always
+ * a unit of their own, nothing extends them.
+ */
+int editorExtendsCluster(uint32_t prev, uint32_t cp, int ripair) {
+    if (cp < 0x300 || prev < 0x20 || prev == 0x7f) return 0;
+    if (prev == 0x200d) return 1;
+    if (cp >= 0x1f3fb && cp <= 0x1f3ff) return 1;
+    if (editorIsRegionalIndicator(cp) && editorIsRegionalIndicator(prev)) return !ripair;
+    return editorCharWidth(cp) == 0;
+}
+
+/*
+ * Return the end of the grapheme cluster starting at byte at, and store
+ * its display width in width
+ */
+int editorClusterNext(const char *s, int len, int at, int *width) {
+    uint32_t prev, cp;
+    int ripair = 0;
+
+    at += editorDecodeUTF8(s + at, len - at, &prev);
+    if (width) *width = editorCharWidth(prev);
+
+    while (at < len) {
+        int n = editorDecodeUTF8(s + at, len - at, &cp);
+        if (!editorExtendsCluster(prev, cp, ripair)) break;
+        if (editorIsRegionalIndicator(cp)) {
+            // A pair of regional indicators draws as one wide flag
+            ripair = 1;
+            if (width) *width = 2;
+        }
+        prev = cp;
+        at += n;
+    }
+    return at;
+}
+
+/*
+ * Start of the code point ending right before byte at
+ */
+int editorCodePointPrev(const char *s, int at) {
+    int j = at - 1;
+    while (j > 0 && at - j < 4 && (s[j] & 0xc0) == 0x80) j--;
+    return j;
+}
+
+/*
+ * Return the start of the grapheme cluster ending right before byte at.
+ * Walks back only over the cluster itself, not from the start of the row.
+ */
+int editorClusterPrev(const char *s, int len, int at) {
+    uint32_t cp, prev;
+    int j = editorCodePointPrev(s, at);
+
+    editorDecodeUTF8(s + j, len - j, &cp);
+    while (j > 0) {
+        int k = editorCodePointPrev(s, j);
+        int ripair = 0;
+        editorDecodeUTF8(s + k, len - k, &prev);
+
+        if (editorIsRegionalIndicator(cp) && editorIsRegionalIndicator(prev)) {
+            // Flags pair up from the start of a run of regional indicators
+            int run = 0, r = j;
+            uint32_t ri;
+            while (r > 0) {
+                r = editorCodePointPrev(s, r);
+                editorDecodeUTF8(s + r, len - r, &ri);
+                if (!editorIsRegionalIndicator(ri)) break;
+                run++;
+            }
+            ripair = run % 2 == 0;
+        }
+        if (!editorExtendsCluster(prev, cp, ripair)) break;
+        j = k;
+        cp = prev;
+    }
+    return j;
+}
+
+/*** soft wrap ***/
+
+/*
+ * The wrap index is a Fenwick tree over the number of screen lines each
+ * row takes, so mapping between rows and screen lines is O(log n).
+ * Each row caches its count in wlines, laid out once and then only again
+ * when the row is edited or the screen width changes. Inserting or
+ * deleting rows marks the tree stale, rebuilding it from the cached
+ * counts only sums ints.
+ */
+
+/*
+ * Remember that screen line p->line of the row being typed into starts
+ * at logical byte at, if it is the next line not known yet
+ */
+void editorGapWrapAdd(int at, wrapPos *p) {
+    gapRow *g = &E.gap;
+    if (p->line != g->wrapn + 1) return;
+
+    if (g->wrapn == g->wrapcap) {
+        g->wrapcap = g->wrapcap ? g->wrapcap * 2 : 16;
+        g->wrapline = realloc(g->wrapline, sizeof(int) * 2 * g->wrapcap);
+        if (g->wrapline == NULL) die("realloc");
+    }
+    g->wrapline[2 * g->wrapn] = at;
+    g->wrapline[2 * g->wrapn + 1] = p->at;
+    g->wrapn++;
+}
+
+/*
+ * Forget the line starts of the row being typed into from the last
+ * cluster before the gap on, editing at the gap can change its width
+ * and everything after it is laid out from the gap
+ */
+void editorGapWrapTrim(erow *row) {
+    gapRow *g = &E.gap;
+    if (!row->wide) return;
+
+    int keep = g->gap > 0 ? editorClusterPrev(row->chars, g->gap, g->gap) : 0;
+    while (g->wrapn > 0 && g->wrapline[2 * (g->wrapn - 1)] >= keep) g->wrapn--;
+}
+
+/*
+ * Lay out s[j, len) continuing from p, stopping like editorWrapWalk.
+ * from is the logical byte s starts at in the row being typed into,
+ * whose line starts are remembered, or -1 for any other row. Returns
+ * whether it stopped before the end of s.
+ */
+int editorWrapSpan(const char *s, int len, int j, wrapPos *p, int stop, int stopline, int from) {
+    int cols = E.screencols;
+
+    while (j < len) {
+        int w = 1;
+        int n = 1;
+        int end = j + 1;
+        if (s[j] == '\t') {
+            // Tabs are drawn as spaces and wrap like them, the spaces
+            // left are known from the column even halfway through one
+            n = NI_TAB_STOP - (p->at % NI_TAB_STOP);
+        } else {
+            end = editorClusterNext(s, len, j, &w);
+        }
+
+        while (n--) {
+            if (p->lx + w > cols && p->lx > 0) {
+                p->line++;
+                p->lx = 0;
+                if (from != -1) editorGapWrapAdd(from + j, p);
+            }
+            if (p->at >= stop || p->line >= stopline) return 1;
+            p->lx += w;
+            p->at += w;
+        }
+        j = end;
+    }
+    return 0;
+}
+
+/*
+ * Lay a row out in screen lines, breaking before a cluster that doesn't
+ * fit in what is left of a line so wide characters are never split.
+ * Walks until display column stop or the start of screen line stopline,
+ * whichever comes first, and returns the screen line reached. *x gets
+ * the column within that line and *col the display column in the row.
+ * The end of a row that exactly fills its last line stays on that line,
+ * with *x equal to the screen width.
+ */
+int editorWrapWalk(erow *row, int stop, int stopline, int *x, int *col) {
+    int cols = E.screencols;
+    wrapPos p = {0, 0, 0};
+
+    if (!row->wide) {
+        // No cluster takes more than a column, so lines break at fixed columns
+        p.at = stop < row->rcols ? stop : row->rcols;
+        p.line = p.at / cols;
+        if (p.line >= stopline) {
+            p.line = stopline;
+            p.at = p.line * cols;
+        }
+        p.lx = p.at - p.line * cols;
+        if (p.at > 0 && p.at == row->rcols && p.lx == 0) {
+            p.line--;
+            p.lx = cols;
+        }
+    } else if (E.gap.row != -1 && row == &E.buf->row[E.gap.row]) {
+        // The row being typed into resumes from the last line start it
+        // knows before stop, then walks both sides of its gap. A line
+        // starting right at stop may follow zero width clusters that
+        // stay on the line before, so it is walked into instead.
+        gapRow *g = &E.gap;
+        if (g->wrapcols != cols) {
+            g->wrapcols = cols;
+            g->wrapn = 0;
+        }
+
+        int lo = 0;
+        int hi = g->wrapn < stopline ? g->wrapn : stopline;
+        while (lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+            if (g->wrapline[2 * mid - 1] < stop) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        int from = 0;
+        if (lo > 0) {
+            from = g->wrapline[2 * lo - 2];
+            p.line = lo;
+            p.at = g->wrapline[2 * lo - 1];
+        }
+
+        if (from >= g->gap || !editorWrapSpan(row->chars, g->gap, from, &p, stop, stopline, 0)) {
+            int j = from > g->gap ? from - g->gap : 0;
+            editorWrapSpan(row->chars + g->gapend, g->cap - g->gapend, j, &p, stop, stopline, g->gap);
+        }
+    } else {
+        editorWrapSpan(row->chars, row->size, 0, &p, stop, stopline, -1);
+    }
+
+    if (x) *x = p.lx;
+    if (col) *col = p.at;
+    return p.line;
+}
+
+int editorRowWrapLines(erow *row) {
+    return editorWrapWalk(row, INT_MAX, INT_MAX, NULL, NULL) + 1;
+}
+
+/*
+ * Display column a screen line of a wrapped row starts at
+ */
+int editorWrapLineStart(erow *row, int line) {
+    int col;
+    editorWrapWalk(row, INT_MAX, line, NULL, &col);
+    return col;
+}
+
+/*
+ * Forget the cached counts once the screen width changed
+ */
+void editorWrapSync(ebuf *b) {
+    if (b->wrapcols == E.screencols) return;
+    b->wrapcols = E.screencols;
+    b->wrapscan = 0;
+    b->wrapn = -1;
+}
+
+int editorWrapValid(ebuf *b) {
+    return b->wrapn != -1 && b->wrapcols == E.screencols;
+}
+
+/*
+ * Lay out rows that have no count yet, about work bytes of them, and
+ * build the tree once all have one. Returns whether the index is done,
+ * calling it again resumes where it stopped.
+ */
+int editorWrapBuild(ebuf *b, long work) {
+    int n = b->numrows;
+    int i;
+
+    editorWrapSync(b);
+    for (; b->wrapscan < n; b->wrapscan++) {
+        if (work <= 0) return 0;
+        erow *row = &b->row[b->wrapscan];
+        row->wlines = editorRowWrapLines(row);
+        // Rows without wide characters are laid out by arithmetic, others
+        // by walking them
+        work -= row->wide ? row->size + 1 : 1;
+    }
+
+    if (n + 1 > b->wrapcap) {
+        b->wrapcap = n + 1;
+        b->wraptree = realloc(b->wraptree, sizeof(int) * b->wrapcap);
+        if (b->wraptree == NULL) die("realloc");
+    }
+
+    // Linear time construction, each node pushes its sum to its parent
+    b->wraptree[0] = 0;
+    for (i = 1; i <= n; ++i) {
+        b->wraptree[i] = b->row[i - 1].wlines;
+    }
+    for (i = 1; i <= n; ++i) {
+        int parent = i + (i & -i);
+        if (parent <= n) b->wraptree[parent] += b->wraptree[i];
+    }
+
+    b->wrapn = n;
+    return 1;
+}
+
+/*
+ * Lay out an edited row again, if its count is cached
+ */
+void editorWrapUpdate(ebuf *b, int at) {
+    editorWrapSync(b);
+    if (at >= b->wrapscan) return;
+
+    int lines = editorRowWrapLines(&b->row[at]);
+    int delta = lines - b->row[at].wlines;
+    if (delta == 0) return;
+
+    b->row[at].wlines = lines;
+    if (!editorWrapValid(b)) return;
+    int i;
+    for (i = at + 1; i <= b->wrapn; i += i & -i) {
+        b->wraptree[i] += delta;
+    }
+}
+
+/*
+ * Keep the cached counts in line with rows inserted or deleted at at.
+ * An inserted row is laid out right away if the rows around it are, so
+ * they stay a prefix of the buffer.
+ */
+void editorWrapInserted(ebuf *b, int at) {
+    editorWrapSync(b);
+    b->wrapn = -1;
+    if (at < b->wrapscan) {
+        b->wrapscan++;
+        b->row[at].wlines = editorRowWrapLines(&b->row[at]);
+    }
+}
+
+void editorWrapDeleted(ebuf *b, int at) {
+    editorWrapSync(b);
+    b->wrapn = -1;
+    if (at < b->wrapscan) b->wrapscan--;
+}
+
+/*
+ * Screen lines taken by the first rows of the buffer
+ */
+int editorWrapPrefix(ebuf *b, int rows) {
+    int sum = 0;
+    for (; rows > 0; rows -= rows & -rows) {
+        sum += b->wraptree[rows];
+    }
+    return sum;
+}
+
+/*
+ * Row containing the given screen line, counted from the top of the file
+ */
+int editorWrapFind(ebuf *b, int line) {
+    int step = 1;
+    int pos = 0;
+
+    while (step * 2 <= b->wrapn) step *= 2;
+    for (; step > 0; step /= 2) {
+        if (pos + step <= b->wrapn && b->wraptree[pos + step] <= line) {
+            pos += step;
+            line -= b->wraptree[pos];
+        }
+    }
+    return pos;
+}
+
+/*
+ * Screen lines taken by a row. Falls back to computing it when it isn't
+ * cached, e.g. right after a resize.
+ */
+int editorWrapLines(ebuf *b, int at) {
+    if (b->wrapcols == E.screencols && at < b->wrapscan) return b->row[at].wlines;
+    return editorRowWrapLines(&b->row[at]);
+}
+
+/*
+ * Screen lines taken by rows from up to but not including to
+ */
+int editorWrapLinesBetween(ebuf *b, int from, int to) {
+    if (editorWrapValid(b)) return editorWrapPrefix(b, to) - editorWrapPrefix(b, from);
+
+    int lines = 0;
+    for (; from < to; ++from) {
+        lines += editorWrapLines(b, from);
+    }
+    return lines;
+}
+
+/*
+ * Screen line of the cursor within its row, and its column on that line
+ * in *x if not NULL
+ */
+int editorWrapCursorSub(int *x) {
+    int cx = 0;
+    int sub = 0;
+    if (E.buf->cy < E.buf->numrows) {
+        sub = editorWrapWalk(&E.buf->row[E.buf->cy], E.buf->rx, INT_MAX, &cx, NULL);
+    }
+
+    // Past the end of a row that exactly fills its last line
+    if (cx >= E.screencols) cx = E.screencols - 1;
+    if (x) *x = cx;
+    return sub;
+}
+
+/*** row operations ***/
+
+/*
+ * Calculate correct cursor x position on screen
+ * with the correct tab indentations
+ */
+int editorRowCxToRx(erow *row, int cx) {
+    int rx = 0;
+    int j;
+
+    if (row->ascii) {
+        // Every byte is a column, only tabs need expanding
+        for (j=0; j < cx; ++j) {
+            if (row->chars[j] == '\t') {
+                rx += (NI_TAB_STOP - 1) - (rx % NI_TAB_STOP);
+            }
+            ++rx;
+        }
+        return rx;
+    }
+
+    j = 0;
+    while (j < cx) {
+        if (row->chars[j] == '\t') {
+            rx += NI_TAB_STOP - (rx % NI_TAB_STOP);
+            j++;
+        } else {
+            int w;
+            j = editorClusterNext(row->chars, row->size, j, &w);
+            rx += w;
+        }
+    }
+    return rx;
+}
+
+/*
+ * Move cx back to the start of the grapheme cluster it points into
+ */
+int editorRowSnapCx(erow *row, int cx) {
+    if (row->ascii) return cx;
+
+    int j = 0;
+    while (j < cx) {
+        int end = editorClusterNext(row->chars, row->size, j, NULL);
+        if (end > cx) break;
+        j = end;
+    }
+    return j;
+}
+
+/*
+ * Drop the render cache of a row, it is rebuilt when the row is drawn
+ */
+void editorFreeRender(erow *row) {
+    if (row->render == NULL) return;
+    E.renderbytes -= row->rsize + 1;
+    free(row->render);
+    row->render = NULL;
+}
+
+void editorUpdateRow(erow *row) {
+    int tabs = 0;
+    int j;
+
+    for (j = 0; j < row->size; ++j) {
+        if (row->chars[j] == '\t') ++tabs;
+    }
+
+    editorFreeRender(row);
+    row->render = malloc(row->size + tabs*(NI_TAB_STOP) + 1);
+    row->ascii = editorIsAscii(row->chars, row->size);
+    row->wide = 0;
+
+    // Multi-byte characters are copied as is, col tracks their width
+    int idx = 0;
+    int col = 0;
+    j = 0;
+    while (j < row->size) {
+        if (row->chars[j] == '\t') {
+            row->render[idx++] = ' ';
+            col++;
+            while (col % NI_TAB_STOP != 0) {
+                row->render[idx++] = ' ';
+                col++;
+            }
+            j++;
+        } else if (row->ascii) {
+            row->render[idx++] = row->chars[j++];
+            col++;
+        } else {
+            int w;
+            int end = editorClusterNext(row->chars, row->size, j, &w);
+            memcpy(&row->render[idx], &row->chars[j], end - j);
+            idx += end - j;
+            col += w;
+            if (w > 1) row->wide = 1;
+            j = end;
+        }
+    }
+    row->render[idx] = '\0';
+    row->rsize = idx;
+    row->rcols = col;
+    E.renderbytes += row->rsize + 1;
+
+    // Keep the wrap index in sync when a row of the current buffer changes
+    if (row >= E.buf->row && row < E.buf->row + E.buf->numrows) {
+        editorWrapUpdate(E.buf, row - E.buf->row);
+    }
+}
+
+void editorInsertRow(ebuf *b, int at, char *s, size_t len) {
+    if (at < 0 || at > b->numrows) return;
+
+    // Render the row before it is in the buffer, the wrap index is kept
+    // up to date for insertions below
+    erow row;
+    row.size = len;
+    row.chars = malloc(len + 1);
+    memcpy(row.chars, s, len);
+    row.chars[len] = '\0';
+
+    row.rsize = 0;
+    row.rcols = 0;
+    row.ascii = 1;
+    row.wide = 0;
+    row.wlines = 0;
+    row.render = NULL;
+    editorUpdateRow(&row);
+
+    if (b->numrows == b->rowcap) {
+        // Grow geometrically so loading large files stays linear
+        b->rowcap = b->rowcap ? b->rowcap * 2 : 64;
+        b->row = realloc(b->row, sizeof(erow) * b->rowcap);
+        if (b->row == NULL) die("realloc");
+    }
+    memmove(&b->row[at + 1], &b->row[at], sizeof(erow) * (b->numrows - at));
+    b->row[at] = row;
+    b->numrows++;
+    editorWrapInserted(b, at);
+}
+
+void editorFreeRow(erow *row) {
+    editorFreeRender(row);
+    free(row->chars);
+}
+
+void editorDelRow(ebuf *b, int at) {
+    if (at < 0 || at >= b->numrows) return;
+    editorFreeRow(&b->row[at]);
+    memmove(&b->row[at], &b->row[at + 1], sizeof(erow) * (b->numrows - at - 1));
+    b->numrows--;
+    editorWrapDeleted(b, at);
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+    row->chars = realloc(row->chars, row->size + len + 1);
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+}
+
+/*** gap buffer ***/
+
+/*
+ * The row being typed into keeps a gap at the cursor in both chars and
+ * render, so inserting or deleting at the cursor doesn't move the rest
+ * of the row. While the gap is open chars and render aren't contiguous:
+ * everything before the cursor is at the start of the allocation and
+ * everything after it at the end. size, rsize and rcols still hold the
+ * logical lengths.
+ *
+ * Only the first tab after the gap changes width when text is inserted
+ * before it, the text after that tab is aligned to a tab stop already.
+ * That tab is tracked and drawn with its current width, while its bytes
+ * in render keep the width it was laid out with, so nothing is moved.
+ */
+
+/*
+ * Make sure the gap in a buffer holds at least need bytes
+ */
+void editorGapReserve(char **b, int gap, int *gapend, int *cap, int need) {
+    if (*gapend - gap >= need) return;
+
+    int post = *cap - *gapend;
+    int ncap = *cap * 2 + need;
+    char *new = realloc(*b, ncap);
+    if (new == NULL) die("realloc");
+
+    memmove(new + ncap - post, new + *gapend, post);
+    *b = new;
+    *gapend = ncap - post;
+    *cap = ncap;
+}
+
+/*
+ * Display columns of the grapheme clusters in s[from, to)
+ */
+int editorSpanCols(const char *s, int from, int to) {
+    int cols = 0;
+    while (from < to) {
+        int w;
+        from = editorClusterNext(s, to, from, &w);
+        cols += w;
+    }
+    return cols;
+}
+
+/*
+ * Width of the tab at byte at, which is before the gap. The text since
+ * the previous tab, or the start of the row, decides where it ends.
+ */
+int editorGapTabWidth(erow *row, int at) {
+    int start = at;
+    while (start > 0 && row->chars[start - 1] != '\t') start--;
+
+    int cols = row->ascii ? at - start : editorSpanCols(row->chars, start, at);
+    return NI_TAB_STOP - cols % NI_TAB_STOP;
+}
+
+/*
+ * Columns the cluster right after the gap loses to the one before it,
+ * like text after a zero width joiner that was just typed. Regional
+ * indicators pair up again once the gap closes, they are left alone.
+ */
+int editorGapJoin(erow *row) {
+    gapRow *g = &E.gap;
+    if (row->ascii || g->gap == 0 || g->gapend == g->cap) return 0;
+
+    uint32_t prev, cp;
+    char *post = row->chars + g->gapend;
+    int len = g->cap - g->gapend;
+    int k = editorCodePointPrev(row->chars, g->gap);
+    editorDecodeUTF8(row->chars + k, g->gap - k, &prev);
+    editorDecodeUTF8(post, len, &cp);
+    if (editorIsRegionalIndicator(prev) && editorIsRegionalIndicator(cp)) return 0;
+    if (!editorExtendsCluster(prev, cp, 0)) return 0;
+
+    int w;
+    editorClusterNext(post, len, 0, &w);
+    return w;
+}
+
+/*
+ * Find the first tab after the gap, base is the display column the text
+ * after the gap was laid out from
+ */
+void editorGapScanTab(erow *row, int base) {
+    gapRow *g = &E.gap;
+    if (g->tabp != -2) return;
+
+    char *post = row->chars + g->gapend;
+    char *tab = memchr(post, '\t', g->cap - g->gapend);
+    if (tab == NULL) {
+        g->tabp = -1;
+        return;
+    }
+
+    g->tabp = tab - post;
+    g->tabcols = row->ascii ? g->tabp : editorSpanCols(post, 0, g->tabp);
+    g->tabw = NI_TAB_STOP - (base + g->tabcols) % NI_TAB_STOP;
+    g->tabr = g->tabw;
+}
+
+/*
+ * Resize the first tab after the gap for the current gap column
+ */
+void editorGapFixTab(erow *row) {
+    gapRow *g = &E.gap;
+    if (g->tabp < 0) return;
+
+    int w = NI_TAB_STOP - (g->rx + g->tabcols - g->join) % NI_TAB_STOP;
+    int delta = w - g->tabw;
+    if (delta == 0) return;
+    g->tabw = w;
+
+    row->rsize += delta;
+    row->rcols += delta;
+    E.renderbytes += delta;
+}
+
+/*
+ * Give the first tab after the gap as many bytes of render as it is
+ * wide, before another tab takes its place. This slides the text between
+ * the gap and the tab, once for each tab the gap moves left past.
+ */
+void editorGapSettleTab(erow *row) {
+    gapRow *g = &E.gap;
+    int delta = g->tabw - g->tabr;
+    if (delta == 0) return;
+
+    memmove(row->render + g->rgapend - delta, row->render + g->rgapend, g->tabp);
+    if (delta > 0) memset(row->render + g->rgapend - delta + g->tabp, ' ', delta);
+    g->rgapend -= delta;
+    g->tabr = g->tabw;
+}
+
+/*
+ * Open a gap at the cursor in the current row
+ */
+void editorGapOpen() {
+    gapRow *g = &E.gap;
+    erow *row = &E.buf->row[E.buf->cy];
+    int cx = E.buf->cx;
+
+    if (row->render == NULL) editorUpdateRow(row);
+
+    // Find where the cursor is in render, tabs expand and everything
+    // else is copied as is. A cluster the cursor is inside of, like a
+    // base character typed before combining marks, is split at the gap.
+    int rx = 0, rbytes = 0, j = 0;
+    while (j < cx) {
+        if (row->chars[j] == '\t') {
+            int w = NI_TAB_STOP - rx % NI_TAB_STOP;
+            rx += w;
+            rbytes += w;
+            j++;
+        } else if (row->ascii) {
+            rx++;
+            rbytes++;
+            j++;
+        } else {
+            int w, end = editorClusterNext(row->chars, cx, j, &w);
+            rx += w;
+            rbytes += end - j;
+            j = end;
+        }
+    }
+
+    int post = row->size - cx;
+    g->cap = row->size + NI_GAP_MIN;
+    row->chars = realloc(row->chars, g->cap);
+    if (row->chars == NULL) die("realloc");
+    memmove(row->chars + g->cap - post, row->chars + cx, post);
+    g->gap = cx;
+    g->gapend = g->cap - post;
+
+    int rpost = row->rsize - rbytes;
+    g->rcap = row->rsize + NI_GAP_MIN;
+    row->render = realloc(row->render, g->rcap);
+    if (row->render == NULL) die("realloc");
+    memmove(row->render + g->rcap - rpost, row->render + rbytes, rpost);
+    g->rgap = rbytes;
+    g->rgapend = g->rcap - rpost;
+
+    g->row = E.buf->cy;
+    g->rx = rx;
+    g->tabp = -2;
+    g->join = editorGapJoin(row);
+    g->wrapn = 0;
+}
+
+/*
+ * Close the gap and put the row back into compact storage
+ */
+void editorGapFlush() {
+    gapRow *g = &E.gap;
+    if (g->row == -1) return;
+
+    erow *row = &E.buf->row[g->row];
+    memmove(row->chars + g->gap, row->chars + g->gapend, g->cap - g->gapend);
+    row->chars = realloc(row->chars, row->size + 1);
+    row->chars[row->size] = '\0';
+    g->row = -1;
+
+    // Rebuild render exactly, this also recomputes the ASCII flag
+    editorUpdateRow(row);
+}
+
+/*
+ * Make sure the gap is open at the cursor
+ */
+erow *editorGapRow() {
+    if (E.gap.row != E.buf->cy) {
+        editorGapFlush();
+        editorGapOpen();
+    }
+    return &E.buf->row[E.gap.row];
+}
+
+/*
+ * Account for a change of the row's text at the gap
+ */
+void editorGapChanged(erow *row, int bytes, int rbytes, int cols) {
+    // The edit can make the cluster after the gap continue the one
+    // before it, or stop doing so
+    int join = editorGapJoin(row);
+    cols += E.gap.join - join;
+    E.gap.join = join;
+
+    row->size += bytes;
+    row->rsize += rbytes;
+    row->rcols += cols;
+    E.renderbytes += rbytes;
+
+    editorGapFixTab(row);
+    editorGapWrapTrim(row);
+    editorWrapUpdate(E.buf, E.gap.row);
+}
+
+void editorGapInsert(int c) {
+    gapRow *g = &E.gap;
+    erow *row = editorGapRow();
+    int w, rbytes;
+
+    editorGapReserve(&row->chars, g->gap, &g->gapend, &g->cap, 1);
+    editorGapReserve(&row->render, g->rgap, &g->rgapend, &g->rcap, NI_TAB_STOP);
+    editorGapScanTab(row, g->rx - g->join);
+
+    row->chars[g->gap++] = c;
+    if (c == '\t') {
+        w = rbytes = NI_TAB_STOP - g->rx % NI_TAB_STOP;
+        memset(row->render + g->rgap, ' ', w);
+    } else if (c & 0x80) {
+        // Width changes of the cluster being typed, a multi-byte
+        // character settles on its width with its last byte. Lay out
+        // from a cluster start both with and without the new byte.
+        int start = editorClusterPrev(row->chars, g->gap, g->gap);
+        int before = editorClusterPrev(row->chars, g->gap - 1, g->gap - 1);
+        if (before < start) start = before;
+        w = editorSpanCols(row->chars, start, g->gap) - editorSpanCols(row->chars, start, g->gap - 1);
+        rbytes = 1;
+        row->render[g->rgap] = c;
+        row->ascii = 0;
+
+        uint32_t cp;
+        int k = editorCodePointPrev(row->chars, g->gap);
+        if (editorDecodeUTF8(row->chars + k, g->gap - k, &cp) == g->gap - k &&
+                (editorCharWidth(cp) > 1 || editorIsRegionalIndicator(cp))) {
+            row->wide = 1;
+        }
+    } else {
+        w = rbytes = 1;
+        row->render[g->rgap] = c;
+    }
+
+    g->rgap += rbytes;
+    g->rx += w;
+    E.buf->cx++;
+    editorGapChanged(row, 1, rbytes, w);
+}
+
+/*
+ * Bytes of the character before the gap
+ */
+int editorGapPrevLen(erow *row) {
+    int at = E.gap.gap;
+    int start = row->ascii ? at - 1 : editorClusterPrev(row->chars, at, at);
+    return at - start;
+}
+
+/*
+ * Delete the character before the gap
+ */
+void editorGapBackspace() {
+    gapRow *g = &E.gap;
+    erow *row = editorGapRow();
+    int n = editorGapPrevLen(row);
+    int k = g->gap - n;
+    int w, rbytes;
+
+    editorGapScanTab(row, g->rx - g->join);
+
+    if (row->chars[k] == '\t') {
+        w = rbytes = editorGapTabWidth(row, k);
+    } else {
+        w = editorSpanCols(row->chars, k, g->gap);
+        rbytes = n;
+    }
+
+    g->gap = k;
+    g->rgap -= rbytes;
+    g->rx -= w;
+    E.buf->cx = k;
+    editorGapChanged(row, -n, -rbytes, -w);
+}
+
+/*
+ * Delete the character after the gap
+ */
+void editorGapDelete() {
+    gapRow *g = &E.gap;
+    erow *row = editorGapRow();
+    int n, w, rbytes;
+
+    editorGapScanTab(row, g->rx - g->join);
+
+    char *post = row->chars + g->gapend;
+    if (post[0] == '\t') {
+        n = 1;
+        w = rbytes = g->tabw;
+        g->gapend++;
+        g->rgapend += g->tabr;
+
+        // The next tab was laid out from the tab stop this one ended at
+        g->tabp = -2;
+        editorGapScanTab(row, g->rx + w);
+    } else {
+        if (row->ascii) {
+            n = w = 1;
+        } else {
+            n = editorClusterNext(post, g->cap - g->gapend, 0, &w);
+        }
+        rbytes = n;
+        g->gapend += n;
+        g->rgapend += n;
+        if (g->tabp >= 0) {
+            g->tabp -= n;
+            g->tabcols -= w;
+        }
+    }
+
+    editorGapChanged(row, -n, -rbytes, -w);
+}
+
+/*
+ * Move the gap one character left or right with the cursor
+ */
+void editorGapMove(int dir) {
+    gapRow *g = &E.gap;
+    erow *row = &E.buf->row[g->row];
+    int n, w, rbytes;
+
+    editorGapReserve(&row->render, g->rgap, &g->rgapend, &g->rcap, NI_TAB_STOP);
+    editorGapScanTab(row, g->rx - g->join);
+
+    if (dir < 0) {
+        n = editorGapPrevLen(row);
+        int k = g->gap - n;
+        if (row->chars[k] == '\t') {
+            // It becomes the first tab after the gap
+            if (g->tabp >= 0) editorGapSettleTab(row);
+            w = rbytes = editorGapTabWidth(row, k);
+            g->tabp = 0;
+            g->tabcols = 0;
+            g->tabw = w;
+            g->tabr = w;
+        } else {
+            w = editorSpanCols(row->chars, k, g->gap);
+            rbytes = n;
+            if (g->tabp >= 0) {
+                g->tabp += n;
+                g->tabcols += w - g->join;
+            }
+        }
+
+        memmove(row->chars + g->gapend - n, row->chars + k, n);
+        memmove(row->render + g->rgapend - rbytes, row->render + g->rgap - rbytes, rbytes);
+        g->gap -= n;
+        g->gapend -= n;
+        g->rgap -= rbytes;
+        g->rgapend -= rbytes;
+        g->rx -= w;
+        E.buf->cx -= n;
+        g->join = editorGapJoin(row);
+    } else {
+        char *post = row->chars + g->gapend;
+        if (post[0] == '\t') {
+            // Spaces as wide as the tab is now, for the bytes it has
+            n = 1;
+            w = rbytes = g->tabw;
+            memset(row->render + g->rgap, ' ', rbytes);
+            g->rgapend += g->tabr;
+            g->tabp = -2;
+        } else {
+            if (row->ascii) {
+                n = w = 1;
+            } else {
+                n = editorClusterNext(post, g->cap - g->gapend, 0, &w);
+            }
+            rbytes = n;
+            memmove(row->render + g->rgap, row->render + g->rgapend, rbytes);
+            g->rgapend += rbytes;
+            if (g->tabp >= 0) {
+                g->tabp -= n;
+                g->tabcols -= w;
+            }
+        }
+
+        memmove(row->chars + g->gap, row->chars + g->gapend, n);
+        g->gap += n;
+        g->gapend += n;
+        g->rgap += rbytes;
+        g->rx += w - g->join;
+        E.buf->cx += n;
+        g->join = editorGapJoin(row);
+    }
+    editorGapWrapTrim(row);
+}
+
+/*** editor operations ***/
+
+void editorInsertChar(int c) {
+    if (E.buf->cy == E.buf->numrows) {
+        editorInsertRow(E.buf, E.buf->numrows, "", 0);
+    }
+    editorGapInsert(c);
+}
+
+void editorInsertNewline() {
+    editorGapFlush();
+
+    if (E.buf->cx == 0) {
+        editorInsertRow(E.buf, E.buf->cy, "", 0);
+    } else {
+        erow *row = &E.buf->row[E.buf->cy];
+        editorInsertRow(E.buf, E.buf->cy + 1, &row->chars[E.buf->cx], row->size - E.buf->cx);
+        row = &E.buf->row[E.buf->cy];
+        row->size = E.buf->cx;
+        row->chars[row->size] = '\0';
+        editorUpdateRow(row);
+    }
+    E.buf->cy++;
+    E.buf->cx = 0;
+}
+
+/*
+ * Delete the character before the cursor, joining with the previous row
+ * at the start of a row
+ */
+void editorDelChar() {
+    if (E.buf->cy == E.buf->numrows) return;
+    if (E.buf->cx == 0 && E.buf->cy == 0) return;
+
+    if (E.buf->cx > 0) {
+        editorGapBackspace();
+        return;
+    }
+
+    editorGapFlush();
+    erow *prev = &E.buf->row[E.buf->cy - 1];
+    E.buf->cx = prev->size;
+    editorRowAppendString(prev, E.buf->row[E.buf->cy].chars, E.buf->row[E.buf->cy].size);
+    editorDelRow(E.buf, E.buf->cy);
+    E.buf->cy--;
+}
+
+/*
+ * Delete the character under the cursor, joining with the next row at
+ * the end of a row
+ */
+void editorDelCharForward() {
+    if (E.buf->cy == E.buf->numrows) return;
+
+    if (E.buf->cx < E.buf->row[E.buf->cy].size) {
+        editorGapDelete();
+        return;
+    }
+    if (E.buf->cy + 1 == E.buf->numrows) return;
+
+    editorGapFlush();
+    erow *next = &E.buf->row[E.buf->cy + 1];
+    editorRowAppendString(&E.buf->row[E.buf->cy], next->chars, next->size);
+    editorDelRow(E.buf, E.buf->cy + 1);
+}
+
+/*** file i/o ***/
+/*
+ * Read a file into a buffer. Returns -1 with errno set, leaving the
+ * buffer untouched, if the file exists but can't be read.
+ */
+int editorOpen(ebuf *b, char *filename) {
+    FILE *fp = fopen(filename, "r");
+    // A file that doesn't exist yet is opened as an empty buffer
+    if (!fp && errno != ENOENT) return -1;
+
+    free(b->filename);
+    b->filename = strdup(filename);
+    if (!fp) return 0;
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    // getline takes a NULL lineptr, current capacity (0), and filepointer
+    // and allocates the memory for the next line it reads.
+    while ((linelen = getline(&line, &linecap, fp)) != -1 ) {
+        // Strip the newline/carriage return characters
+        while (linelen > 0 && (line[linelen-1] == '\n' || line[linelen-1] == '\r')) {
+            linelen--;
+        }
+        // Copy to our editor row buffer
+        editorInsertRow(b, b->numrows, line, linelen);
+    }
+    free(line);
+    fclose(fp);
+    return 0;
+}
+
+/*** buffers ***/
+
+ebuf *editorNewBuffer() {
+    ebuf *b = calloc(1, sizeof(ebuf));
+    if (b == NULL) die("calloc");
+
+    E.buffers = realloc(E.buffers, sizeof(ebuf *) * (E.numbufs + 1));
+    if (E.buffers == NULL) die("realloc");
+    E.buffers[E.numbufs++] = b;
+    return b;
+}
+
+int editorBufferIndex(ebuf *b) {
+    int j;
+    for (j = 0; j < E.numbufs; ++j) {
+        if (E.buffers[j] == b) return j;
+    }
+    return -1;
+}
+
+ebuf *editorFindBuffer(const char *filename) {
+    int j;
+    for (j = 0; j < E.numbufs; ++j) {
+        if (E.buffers[j]->filename && strcmp(E.buffers[j]->filename, filename) == 0) {
+            return E.buffers[j];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Drop the render caches of buffers that have been hidden the longest
+ * until the shared render budget is met again. Buffers hidden for less
+ * than NI_BUFFER_IDLE are kept so flipping between buffers stays instant.
+ */
+void editorReclaimRenders() {
+    time_t now = time(NULL);
+
+    while (E.renderbytes > NI_RENDER_BUDGET) {
+        ebuf *oldest = NULL;
+        int j;
+        for (j = 0; j < E.numbufs; ++j) {
+            ebuf *b = E.buffers[j];
+            if (b == E.buf || now - b->lastshown < NI_BUFFER_IDLE) continue;
+            // Skip buffers whose renders are already gone
+            if (b->numrows == 0 || b->row[0].render == NULL) continue;
+            if (oldest == NULL || b->lastshown < oldest->lastshown) oldest = b;
+        }
+        if (oldest == NULL) return;
+
+        for (j = 0; j < oldest->numrows; ++j) {
+            editorFreeRender(&oldest->row[j]);
+        }
+    }
+}
+
+/*
+ * Make another buffer current. Each buffer keeps its own rows and view,
+ * so this only swaps the pointer.
+ */
+void editorSwitchBuffer(ebuf *b) {
+    if (b == E.buf) return;
+    E.buf->lastshown = time(NULL);
+    E.buf = b;
+    editorReclaimRenders();
+}
+
+/*
+ * Open a file in its own buffer, or switch to it if it is already open.
+ * Returns -1 if it can't be read, the current buffer is kept then.
+ */
+int editorEdit(char *filename) {
+    ebuf *b = editorFindBuffer(filename);
+    if (b) {
+        editorSwitchBuffer(b);
+        return 0;
+    }
+
+    // Reuse the current buffer if it's an empty unnamed one
+    int fresh = E.buf->filename || E.buf->numrows;
+    b = fresh ? editorNewBuffer() : E.buf;
+    if (editorOpen(b, filename) == -1) {
+        editorSetStatusMsg("Can't open %s: %s", filename, strerror(errno));
+        if (fresh) {
+            // The new buffer is the last one, drop it again
+            E.numbufs--;
+            free(b);
+        }
+        return -1;
+    }
+    editorSwitchBuffer(b);
+    editorReclaimRenders();
+    return 0;
+}
+
+/*
+ * Cycle through buffers, dir is 1 for next and -1 for previous
+ */
+void editorCycleBuffer(int dir) {
+    int at = editorBufferIndex(E.buf);
+    editorSwitchBuffer(E.buffers[(at + dir + E.numbufs) % E.numbufs]);
+}
+
+/*
+ * Write an escape sequence to the screen.
+ * Escape sequence begins with the "\x1b"
+ * byte which means ESCAPE or 27 in decimal,
+ * followed by '['.
+ * '2J' clears the entire screen
+ */
+void editorExit() {
+    write(STDOUT_FILENO, "\x1b[2J", 4);
+    write(STDOUT_FILENO, "\x1b[H", 3);
+    exit(0);
+}
+
+/*** project search ***/
+
+/*
+ * :grep and :find walk the working directory on a pool of worker
+ * threads. Each worker owns a deque of directories and files to look at,
+ * it pushes and pops at the bottom and steals from the top of the other
+ * workers' deques when its own runs dry. Results are handed to the input
+ * loop in batches and a byte on a pipe wakes it up to stream them into
+ * the results buffer, so the editor stays responsive while searching.
+ */
+
+typedef struct {
+    char *pattern;
+    int negate; // Pattern starts with !
+    int dironly; // Pattern ends with /
+    int anchored; // Pattern contains a /, so it matches the path from the .gitignore
+} ignoreRule;
+
+typedef struct ignoreSet {
+    char *base; // Directory of the .gitignore, "" for the root
+    ignoreRule *rules;
+    int numrules;
+    struct ignoreSet *parent; // .gitignore of an enclosing directory
+    struct ignoreSet *next; // All sets of a search, to free them
+} ignoreSet;
+
+typedef struct {
+    char *path; // Relative to the working directory, "." for the root
+    ignoreSet *ignore; // Innermost .gitignore that applies
+    int isdir;
+} searchTask;
+
+typedef struct {
+    pthread_mutex_t lock;
+    searchTask **tasks;
+    int head; // Thieves take from here
+    int len; // The owner pushes and pops here
+    int cap;
+} taskDeque;
+
+typedef struct search {
+    enum bufferKinds kind;
+    char *pattern;
+    int patlen;
+    ebuf *out; // Buffer results are streamed into
+
+    int numworkers;
+    pthread_t *threads;
+    taskDeque *deques;
+
+    pthread_mutex_t lock; // Guards everything below
+    pthread_cond_t wake; // Signalled when work is pushed or runs out
+    int pending; // Tasks queued or being worked on
+    unsigned int pushes; // Bumped on every push, idle workers wait on it
+    int cancel;
+    int running; // Workers that haven't exited yet
+    char **results; // Batched results not drained yet
+    int numresults;
+    int rescap;
+    int total; // Results found so far
+    ignoreSet *ignores;
+
+    int pipe[2]; // Wakes the input loop when results arrive
+} search;
+
+typedef struct {
+    search *s;
+    int id;
+} searchWorker;
+
+/*
+ * Read a .gitignore into a new set, NULL if the directory has none
+ */
+ignoreSet *editorLoadIgnore(search *s, const char *dir, ignoreSet *parent) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/.gitignore", dir);
+    FILE *fp = fopen(path, "r");
+    if (!fp) return NULL;
+
+    ignoreSet *set = calloc(1, sizeof(ignoreSet));
+    set->base = strdup(strcmp(dir, ".") == 0 ? "" : dir);
+    set->parent = parent;
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t len;
+    int cap = 0;
+    while ((len = getline(&line, &linecap, fp)) != -1) {
+        while (len > 0 && isspace((unsigned char) line[len - 1])) line[--len] = '\0';
+        if (len == 0 || line[0] == '#') continue;
+
+        ignoreRule r = {0};
+        char *p = line;
+        if (*p == '!') {
+            r.negate = 1;
+            p++;
+        }
+        if (p[0] && p[strlen(p) - 1] == '/') {
+            r.dironly = 1;
+            p[strlen(p) - 1] = '\0';
+        }
+        // A leading **/ matches in any directory, like no slash at all
+        if (strncmp(p, "**/", 3) == 0) p += 3;
+        if (strchr(p, '/')) {
+            r.anchored = 1;
+            if (*p == '/') p++;
+        }
+        if (*p == '\0') continue;
+        r.pattern = strdup(p);
+
+        if (set->numrules == cap) {
+            cap = cap ? cap * 2 : 8;
+            set->rules = realloc(set->rules, sizeof(ignoreRule) * cap);
+        }
+        set->rules[set->numrules++] = r;
+    }
+    free(line);
+    fclose(fp);
+
+    pthread_mutex_lock(&s->lock);
+    set->next = s->ignores;
+    s->ignores = set;
+    pthread_mutex_unlock(&s->lock);
+    return set;
+}
+
+/*
+ * Whether a path is ignored. The last matching rule of the innermost
+ * .gitignore that has one decides, .git itself is always skipped.
+ */
+int editorIsIgnored(ignoreSet *set, const char *path, const char *name, int isdir) {
+    if (strcmp(name, ".git") == 0) return 1;
+
+    for (; set; set = set->parent) {
+        int baselen = strlen(set->base);
+        const char *rel = baselen ? path + baselen + 1 : path;
+        int j;
+        for (j = set->numrules - 1; j >= 0; --j) {
+            ignoreRule *r = &set->rules[j];
+            if (r->dironly && !isdir) continue;
+            if (fnmatch(r->pattern, r->anchored ? rel : name, r->anchored ? FNM_PATHNAME : 0) == 0) {
+                return !r->negate;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Score how well a path matches a fuzzy query, -1 if the query's
+ * characters don't all appear in order. Runs of consecutive characters,
+ * matches at the start of a word and matches in the file name score
+ * higher, and shorter paths win ties.
+ */
+int editorFuzzyScore(const char *path, const char *query) {
+    const char *name = strrchr(path, '/');
+    int base = name ? name - path + 1 : 0;
+    int score = 0;
+    int prev = -2;
+    int j;
+
+    for (j = 0; path[j] && *query; ++j) {
+        if (tolower((unsigned char) path[j]) != tolower((unsigned char) *query)) continue;
+
+        score += 1;
+        if (j == prev + 1) score += 5;
+        if (j == 0 || strchr("/_-. ", path[j - 1])) score += 3;
+        if (j >= base) score += 2;
+        prev = j;
+        query++;
+    }
+    if (*query) return -1;
+    return score * 100 - (int) strlen(path);
+}
+
+/*
+ * Hand a batch of results to the input loop
+ */
+void editorSearchEmit(search *s, char **results, int n) {
+    if (n == 0) return;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->numresults + n > s->rescap) {
+        s->rescap = (s->numresults + n) * 2;
+        s->results = realloc(s->results, sizeof(char *) * s->rescap);
+    }
+    memcpy(&s->results[s->numresults], results, sizeof(char *) * n);
+    s->numresults += n;
+    s->total += n;
+    if (s->total >= NI_SEARCH_MAX_RESULTS) {
+        s->cancel = 1;
+        pthread_cond_broadcast(&s->wake);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (write(s->pipe[1], "r", 1) == -1) {
+        // The pipe is full, the input loop has a wakeup coming already
+    }
+}
+
+int editorSearchCancelled(search *s) {
+    pthread_mutex_lock(&s->lock);
+    int cancel = s->cancel;
+    pthread_mutex_unlock(&s->lock);
+    return cancel;
+}
 
 /*
- * Calculate correct cursor x position on screen
- * with the correct tab indentations
+ * Search a file through mmap and emit one result per matching line
  */
-int editorRowCxToRx(erow *row, int cx) {
-    int rx = 0;
-    int j;
-    for (j=0; j < cx; ++j) {
-        if (row->chars[j] == '\t') {
-            rx += (NI_TAB_STOP - 1) - (rx % NI_TAB_STOP);
+void editorGrepFile(search *s, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    size_t size = st.st_size;
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return;
+
+    // Skip binary files
+    if (memchr(data, '\0', size < 8000 ? size : 8000)) {
+        munmap(data, size);
+        return;
+    }
+
+    char *batch[64];
+    int n = 0;
+    int line = 1;
+    char *counted = data; // Lines are counted up to here
+    char *end = data + size;
+    char *from = data;
+    while (from < end) {
+        // Search a chunk at a time so a cancelled search stops in the
+        // middle of a big file, chunks overlap by the pattern length so
+        // a match across their boundary is still found
+        char *limit = end - from > NI_SEARCH_CHUNK ? from + NI_SEARCH_CHUNK : end;
+        char *hit = memmem(from, limit - from, s->pattern, s->patlen);
+        if (hit == NULL) {
+            if (limit == end || editorSearchCancelled(s)) break;
+            from = limit - (s->patlen - 1);
+            continue;
+        }
+
+        char *bol = hit;
+        while (bol > data && bol[-1] != '\n') bol--;
+        char *eol = memchr(hit, '\n', end - hit);
+        if (eol == NULL) eol = end;
+
+        char *p;
+        for (p = counted; (p = memchr(p, '\n', bol - p)) != NULL; p++) line++;
+        counted = bol;
+
+        int textlen = eol - bol;
+        if (textlen > 0 && bol[textlen - 1] == '\r') textlen--;
+        if (textlen > NI_SEARCH_MAX_LINE) textlen = NI_SEARCH_MAX_LINE;
+        int len = snprintf(NULL, 0, "%s:%d: ", path, line);
+        batch[n] = malloc(len + textlen + 1);
+        snprintf(batch[n], len + 1, "%s:%d: ", path, line);
+        memcpy(batch[n] + len, bol, textlen);
+        batch[n][len + textlen] = '\0';
+
+        if (++n == 64) {
+            editorSearchEmit(s, batch, n);
+            n = 0;
+            if (editorSearchCancelled(s)) break;
         }
-        ++rx;
+        if (eol == end) break;
+        from = eol + 1;
     }
-    return rx;
+    editorSearchEmit(s, batch, n);
+    munmap(data, size);
 }
 
-void editorUpdateRow(erow *row) {
-    int tabs = 0;
+void editorSearchPush(search *s, int id, char *path, ignoreSet *ignore, int isdir) {
+    taskDeque *d = &s->deques[id];
+    searchTask *t = malloc(sizeof(searchTask));
+    t->path = path;
+    t->ignore = ignore;
+    t->isdir = isdir;
+
+    // Counted before it can be taken, otherwise a thief could finish it
+    // and drop the count to zero while the pusher is still walking
+    pthread_mutex_lock(&s->lock);
+    s->pending++;
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_mutex_lock(&d->lock);
+    if (d->len == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 64;
+        d->tasks = realloc(d->tasks, sizeof(searchTask *) * d->cap);
+    }
+    d->tasks[d->len++] = t;
+    pthread_mutex_unlock(&d->lock);
+
+    // Wake an idle worker now that there is something to take
+    pthread_mutex_lock(&s->lock);
+    s->pushes++;
+    pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Take the newest task from a worker's own deque, or the oldest one from
+ * somebody else's
+ */
+searchTask *editorSearchTake(search *s, int id) {
+    searchTask *t = NULL;
     int j;
 
-    for (j = 0; j < row->size; ++j) {
-        if (row->chars[j] == '\t') ++tabs;
+    for (j = 0; j < s->numworkers && t == NULL; ++j) {
+        taskDeque *d = &s->deques[(id + j) % s->numworkers];
+        pthread_mutex_lock(&d->lock);
+        if (d->head < d->len) {
+            t = j == 0 ? d->tasks[--d->len] : d->tasks[d->head++];
+            if (d->head == d->len) d->head = d->len = 0;
+        }
+        pthread_mutex_unlock(&d->lock);
     }
+    return t;
+}
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(NI_TAB_STOP) + 1);
+void editorSearchDir(search *s, int id, searchTask *t) {
+    ignoreSet *ignore = editorLoadIgnore(s, t->path, t->ignore);
+    if (ignore == NULL) ignore = t->ignore;
+
+    DIR *dir = opendir(t->path);
+    if (dir == NULL) return;
+
+    char *batch[64];
+    int n = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        // Huge directories are walked an entry at a time, stop as soon
+        // as the search is cancelled
+        if (editorSearchCancelled(s)) break;
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+        char *path;
+        if (strcmp(t->path, ".") == 0) {
+            path = strdup(de->d_name);
+        } else {
+            path = malloc(strlen(t->path) + strlen(de->d_name) + 2);
+            sprintf(path, "%s/%s", t->path, de->d_name);
+        }
 
-    int idx = 0;
-    for (j = 0; j < row->size; ++j) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % NI_TAB_STOP != 0) row->render[idx++] = ' ';
+        // Symlinks are skipped so the walk can't loop
+        int type = de->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            type = lstat(path, &st) == -1 ? DT_UNKNOWN
+                : S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if ((type != DT_DIR && type != DT_REG) || editorIsIgnored(ignore, path, de->d_name, type == DT_DIR)) {
+            free(path);
+            continue;
+        }
+
+        if (type == DT_DIR) {
+            editorSearchPush(s, id, path, ignore, 1);
+        } else if (s->kind == GREP_BUFFER) {
+            editorSearchPush(s, id, path, ignore, 0);
+        } else if (editorFuzzyScore(path, s->pattern) >= 0) {
+            batch[n++] = path;
+            if (n == 64) {
+                editorSearchEmit(s, batch, n);
+                n = 0;
+            }
         } else {
-            row->render[idx++] = row->chars[j];
+            free(path);
         }
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
+    closedir(dir);
+    editorSearchEmit(s, batch, n);
 }
 
-void editorAppendRow(char *s, size_t len) {
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+void *editorSearchWorker(void *arg) {
+    search *s = ((searchWorker *) arg)->s;
+    int id = ((searchWorker *) arg)->id;
+    free(arg);
 
-    int at = E.numrows;
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+    while (1) {
+        pthread_mutex_lock(&s->lock);
+        unsigned int seen = s->pushes;
+        int cancel = s->cancel;
+        pthread_mutex_unlock(&s->lock);
+        if (cancel) break;
+
+        searchTask *t = editorSearchTake(s, id);
+        if (t) {
+            if (t->isdir) {
+                editorSearchDir(s, id, t);
+            } else {
+                editorGrepFile(s, t->path);
+            }
+            free(t->path);
+            free(t);
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    editorUpdateRow(&E.row[at]);
+            pthread_mutex_lock(&s->lock);
+            if (--s->pending == 0) pthread_cond_broadcast(&s->wake);
+            pthread_mutex_unlock(&s->lock);
+            continue;
+        }
 
-    E.numrows++;
-}
+        // Nothing to take, wait for a push or for the walk to finish
+        pthread_mutex_lock(&s->lock);
+        while (s->pending > 0 && s->pushes == seen && !s->cancel) {
+            pthread_cond_wait(&s->wake, &s->lock);
+        }
+        int done = s->pending == 0 || s->cancel;
+        pthread_mutex_unlock(&s->lock);
+        if (done) break;
+    }
 
-/*** file i/o ***/
-void editorOpen(char *filename) {
-    free(E.filename);
-    E.filename = strdup(filename);
+    pthread_mutex_lock(&s->lock);
+    s->running--;
+    pthread_cond_broadcast(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+    if (write(s->pipe[1], "d", 1) == -1) {
+        // The pipe is full, the input loop has a wakeup coming already
+    }
+    return NULL;
+}
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp) die("fopen");
+/*
+ * Stop a search, wait for its workers and free it
+ */
+void editorSearchEnd(search *s) {
+    int j;
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    // getline takes a NULL lineptr, current capacity (0), and filepointer
-    // and allocates the memory for the next line it reads.
-    while ((linelen = getline(&line, &linecap, fp)) != -1 ) {
-        // Strip the newline/carriage return characters
-        while (linelen > 0 && (line[linelen-1] == '\n' || line[linelen-1] == '\r')) {
-            linelen--;
+    pthread_mutex_lock(&s->lock);
+    s->cancel = 1;
+    pthread_cond_broadcast(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+    for (j = 0; j < s->numworkers; ++j) pthread_join(s->threads[j], NULL);
+
+    for (j = 0; j < s->numworkers; ++j) {
+        taskDeque *d = &s->deques[j];
+        for (; d->head < d->len; d->head++) {
+            free(d->tasks[d->head]->path);
+            free(d->tasks[d->head]);
         }
-        // Copy to our editor row buffer
-        editorAppendRow(line, linelen);
+        free(d->tasks);
+        pthread_mutex_destroy(&d->lock);
     }
-    free(line);
-    fclose(fp);
+    for (j = 0; j < s->numresults; ++j) free(s->results[j]);
+    while (s->ignores) {
+        ignoreSet *next = s->ignores->next;
+        int k;
+        for (k = 0; k < s->ignores->numrules; ++k) free(s->ignores->rules[k].pattern);
+        free(s->ignores->rules);
+        free(s->ignores->base);
+        free(s->ignores);
+        s->ignores = next;
+    }
+
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->wake);
+    close(s->pipe[0]);
+    close(s->pipe[1]);
+    free(s->results);
+    free(s->deques);
+    free(s->threads);
+    free(s->pattern);
+    free(s);
+    E.search = NULL;
+}
+
+typedef struct {
+    int score;
+    erow row;
+} scoredRow;
+
+int editorCompareScored(const void *a, const void *b) {
+    return ((const scoredRow *) b)->score - ((const scoredRow *) a)->score;
 }
 
 /*
- * Write an escape sequence to the screen.
- * Escape sequence begins with the "\x1b"
- * byte which means ESCAPE or 27 in decimal,
- * followed by '['.
- * '2J' clears the entire screen
+ * Order :find results best match first once they are all in
  */
-void editorExit() {
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
-    exit(0);
+void editorSortFindResults(ebuf *b, const char *query) {
+    if (b == E.buf) editorGapFlush();
+
+    scoredRow *rows = malloc(sizeof(scoredRow) * b->numrows);
+    int j;
+    for (j = 0; j < b->numrows; ++j) {
+        rows[j].score = editorFuzzyScore(b->row[j].chars, query);
+        rows[j].row = b->row[j];
+    }
+    qsort(rows, b->numrows, sizeof(scoredRow), editorCompareScored);
+    for (j = 0; j < b->numrows; ++j) b->row[j] = rows[j].row;
+    free(rows);
+
+    // Rows moved, so the wrap index has to be rebuilt. The cached counts
+    // move with their rows, but only a fully laid out buffer keeps them.
+    b->wrapn = -1;
+    if (b->wrapscan < b->numrows) b->wrapscan = 0;
+}
+
+/*
+ * Move results that arrived into the results buffer, and wrap up the
+ * search once all workers are done. Called from the input loop.
+ */
+void editorSearchPoll() {
+    search *s = E.search;
+    if (s == NULL) return;
+
+    char drain[64];
+    while (read(s->pipe[0], drain, sizeof(drain)) > 0) {}
+
+    pthread_mutex_lock(&s->lock);
+    char **results = s->results;
+    int n = s->numresults;
+    int running = s->running;
+    int total = s->total;
+    s->results = NULL;
+    s->numresults = 0;
+    s->rescap = 0;
+    pthread_mutex_unlock(&s->lock);
+
+    int j;
+    for (j = 0; j < n; ++j) {
+        editorInsertRow(s->out, s->out->numrows, results[j], strlen(results[j]));
+        free(results[j]);
+    }
+    free(results);
+    if (n) E.framepending = 1;
+
+    if (running == 0) {
+        if (s->kind == FIND_BUFFER) editorSortFindResults(s->out, s->pattern);
+        editorSetStatusMsg("%s: %d %s%s", s->kind == GREP_BUFFER ? "grep" : "find", total,
+                s->kind == GREP_BUFFER ? "matches" : "files",
+                total >= NI_SEARCH_MAX_RESULTS ? " (stopped)" : "");
+        E.framepending = 1;
+        editorSearchEnd(s);
+    }
+}
+
+/*
+ * Start :grep or :find, results go into a buffer of that kind which is
+ * reused between searches
+ */
+void editorSearchStart(enum bufferKinds kind, char *pattern) {
+    if (kind == GREP_BUFFER && *pattern == '\0') {
+        editorSetStatusMsg("grep: no pattern");
+        return;
+    }
+    if (E.search) editorSearchEnd(E.search);
+    editorGapFlush();
+
+    ebuf *out = NULL;
+    int j;
+    for (j = 0; j < E.numbufs; ++j) {
+        if (E.buffers[j]->kind == kind) out = E.buffers[j];
+    }
+    if (out == NULL) {
+        out = editorNewBuffer();
+        out->kind = kind;
+        out->filename = strdup(kind == GREP_BUFFER ? "[Quickfix]" : "[Find]");
+    }
+    while (out->numrows) editorDelRow(out, out->numrows - 1);
+    out->cx = out->cy = out->rowoff = out->rowoffsub = out->coloff = 0;
+    editorSwitchBuffer(out);
+
+    search *s = calloc(1, sizeof(search));
+    s->kind = kind;
+    s->pattern = strdup(pattern);
+    s->patlen = strlen(pattern);
+    s->out = out;
+    if (pipe(s->pipe) == -1) die("pipe");
+    fcntl(s->pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(s->pipe[1], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    s->numworkers = cpus < 1 ? 1 : cpus > NI_SEARCH_MAX_THREADS ? NI_SEARCH_MAX_THREADS : cpus;
+    s->deques = calloc(s->numworkers, sizeof(taskDeque));
+    s->threads = calloc(s->numworkers, sizeof(pthread_t));
+    for (j = 0; j < s->numworkers; ++j) pthread_mutex_init(&s->deques[j].lock, NULL);
+
+    E.search = s;
+    editorSearchPush(s, 0, strdup("."), NULL, 1);
+
+    s->running = s->numworkers;
+    for (j = 0; j < s->numworkers; ++j) {
+        searchWorker *w = malloc(sizeof(searchWorker));
+        w->s = s;
+        w->id = j;
+        // Workers inherit the blocked SIGWINCH, so only the input loop gets it
+        if (pthread_create(&s->threads[j], NULL, editorSearchWorker, w) != 0) die("pthread_create");
+    }
+    editorSetStatusMsg("%s: searching...", kind == GREP_BUFFER ? "grep" : "find");
+}
+
+/*
+ * Open the result under the cursor, at its line for :grep results
+ */
+void editorSearchPick() {
+    if (E.buf->cy >= E.buf->numrows) return;
+
+    erow *row = &E.buf->row[E.buf->cy];
+    char *path = strdup(row->chars);
+    int line = 0;
+
+    if (E.buf->kind == GREP_BUFFER) {
+        // Results look like path:line: text
+        char *p = path;
+        while ((p = strchr(p, ':')) != NULL) {
+            char *end;
+            long n = strtol(p + 1, &end, 10);
+            if (end > p + 1 && *end == ':') {
+                *p = '\0';
+                line = n;
+                break;
+            }
+            p++;
+        }
+        if (p == NULL) {
+            free(path);
+            return;
+        }
+    }
+
+    int err = editorEdit(path);
+    free(path);
+    if (err == 0 && line > 0) {
+        E.buf->cy = line - 1 < E.buf->numrows ? line - 1 : E.buf->numrows;
+        E.buf->cx = 0;
+    }
 }
 
 /*** Normal mode ***/
@@ -389,60 +2554,264 @@ void editorNormalModeNumRep(int n) {
 /*** Command mode ***/
 
 /*
- * Handle command mode commands
+ * List open buffers in the message bar
  */
-void editorCommandModeHandle() {
+void editorListBuffers() {
+    char list[sizeof(E.statusmsg)];
+    int len = 0;
     int j;
-    int _write = 0;
-    int _quit = 0;
-    for (j=0; j<E.cmdbuf.len; ++j) {
-        if (E.cmdbuf.b[j] == 'q') {
-            _quit = 1;
-        }
+    list[0] = '\0';
+    for (j = 0; j < E.numbufs && len < (int) sizeof(list); ++j) {
+        ebuf *b = E.buffers[j];
+        len += snprintf(list + len, sizeof(list) - len, "%s%d%s \"%s\"",
+                j ? "  " : "", j + 1, b == E.buf ? "%" : "",
+                b->filename ? b->filename : "[No name]");
+    }
+    editorSetStatusMsg("%s", list);
+}
+
+/*
+ * Handle :set options
+ */
+void editorSetOption(char *opt) {
+    if (strcmp(opt, "wrap") == 0) {
+        E.wrap = 1;
+    } else if (strcmp(opt, "nowrap") == 0) {
+        E.wrap = 0;
+    } else if (strcmp(opt, "sync") == 0) {
+        E.sync = 1;
+    } else if (strcmp(opt, "nosync") == 0) {
+        E.sync = 0;
+    } else if (strncmp(opt, "maxfps=", 7) == 0) {
+        E.maxfps = atoi(opt + 7);
+        if (E.maxfps < 0) E.maxfps = 0;
+    } else {
+        editorSetStatusMsg("Unknown option: %s", opt);
     }
-    if (_write) {
-        // Write file here
+}
+
+/*
+ * Whether cmd quits the editor. :wq and :x quit too, writing files isn't
+ * supported yet so there is nothing to write first.
+ */
+int editorIsQuitCommand(const char *cmd) {
+    const char *quit[] = {"q", "q!", "qa", "qa!", "quit", "wq", "wq!", "wqa", "x", "x!", "xa"};
+    size_t j;
+    for (j = 0; j < sizeof(quit) / sizeof(quit[0]); ++j) {
+        if (strcmp(cmd, quit[j]) == 0) return 1;
     }
+    return 0;
+}
 
-    if (_quit) editorExit();
+/*
+ * Handle command mode commands
+ */
+void editorCommandModeHandle() {
+    char cmd[256];
+    int len = E.cmdbuf.len < (int) sizeof(cmd) - 1 ? E.cmdbuf.len : (int) sizeof(cmd) - 1;
+    memcpy(cmd, E.cmdbuf.b, len);
+    cmd[len] = '\0';
+
+    // Split the command name from its argument
+    char *arg = cmd;
+    while (*arg && !isspace(*arg)) arg++;
+    if (*arg) *arg++ = '\0';
+    while (isspace(*arg)) arg++;
+
+    if (editorIsQuitCommand(cmd)) {
+        editorExit();
+    } else if (strcmp(cmd, "w") == 0 || strcmp(cmd, "w!") == 0 || strcmp(cmd, "write") == 0) {
+        editorSetStatusMsg("Writing files is not supported yet");
+    } else if (strcmp(cmd, "e") == 0 || strcmp(cmd, "edit") == 0) {
+        if (*arg) {
+            editorEdit(arg);
+        } else {
+            editorSetStatusMsg("No file name");
+        }
+    } else if (strcmp(cmd, "bn") == 0 || strcmp(cmd, "bnext") == 0) {
+        editorCycleBuffer(1);
+    } else if (strcmp(cmd, "bp") == 0 || strcmp(cmd, "bprevious") == 0) {
+        editorCycleBuffer(-1);
+    } else if (strcmp(cmd, "b") == 0 || strcmp(cmd, "buffer") == 0) {
+        int n = atoi(arg);
+        if (n >= 1 && n <= E.numbufs) {
+            editorSwitchBuffer(E.buffers[n - 1]);
+        } else {
+            editorSetStatusMsg("Buffer %s does not exist", arg);
+        }
+    } else if (strcmp(cmd, "set") == 0) {
+        editorSetOption(arg);
+    } else if (strcmp(cmd, "ls") == 0 || strcmp(cmd, "buffers") == 0) {
+        editorListBuffers();
+    } else if (strcmp(cmd, "grep") == 0) {
+        editorSearchStart(GREP_BUFFER, arg);
+    } else if (strcmp(cmd, "find") == 0) {
+        editorSearchStart(FIND_BUFFER, arg);
+    } else if (cmd[0]) {
+        editorSetStatusMsg("Not an editor command: %s", cmd);
+    }
 }
 
 /*** output ***/
 
 void editorScroll() {
-    E.rx = 0;
-    if (E.cy < E.numrows) {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    E.buf->rx = 0;
+    if (E.gap.row != -1 && E.gap.row == E.buf->cy) {
+        // The gap tracks its column while typing
+        E.buf->rx = E.gap.rx;
+    } else if (E.buf->cy < E.buf->numrows) {
+        E.buf->rx = editorRowCxToRx(&E.buf->row[E.buf->cy], E.buf->cx);
+    }
+
+    if (E.wrap) {
+        // Rows wrap, so scroll by screen lines and never horizontally. The
+        // top can be inside a row that is taller than the screen.
+        E.buf->coloff = 0;
+        int sub = editorWrapCursorSub(NULL);
+
+        if (E.buf->rowoff >= E.buf->numrows) {
+            E.buf->rowoffsub = 0;
+        } else if (E.buf->rowoffsub >= editorWrapLines(E.buf, E.buf->rowoff)) {
+            // The top row got shorter
+            E.buf->rowoffsub = editorWrapLines(E.buf, E.buf->rowoff) - 1;
+        }
+
+        if (E.buf->cy < E.buf->rowoff) {
+            // Show the row from its start if the cursor still fits
+            E.buf->rowoff = E.buf->cy;
+            E.buf->rowoffsub = sub < E.screenrows ? 0 : sub - E.screenrows + 1;
+        } else if (E.buf->cy == E.buf->rowoff && sub < E.buf->rowoffsub) {
+            E.buf->rowoffsub = sub;
+        } else if (editorWrapValid(E.buf)) {
+            int top = editorWrapPrefix(E.buf, E.buf->cy) + sub - E.screenrows + 1;
+            if (top > editorWrapPrefix(E.buf, E.buf->rowoff) + E.buf->rowoffsub) {
+                E.buf->rowoff = editorWrapFind(E.buf, top);
+                E.buf->rowoffsub = top - editorWrapPrefix(E.buf, E.buf->rowoff);
+            }
+        } else {
+            // The index is rebuilt once the editor is idle, until then walk
+            // up from the cursor at most a screenful of lines
+            int row = E.buf->cy;
+            int line = sub;
+            int n = E.screenrows - 1;
+            while (n > 0 && (row > E.buf->rowoff || line > E.buf->rowoffsub)) {
+                if (line > 0) {
+                    line--;
+                } else {
+                    row--;
+                    line = editorWrapLines(E.buf, row) - 1;
+                }
+                n--;
+            }
+            if (n == 0) {
+                E.buf->rowoff = row;
+                E.buf->rowoffsub = line;
+            }
+        }
+        return;
     }
 
-    if (E.cy < E.rowoff) {
-        E.rowoff = E.cy;
+    E.buf->rowoffsub = 0;
+    if (E.buf->cy < E.buf->rowoff) {
+        E.buf->rowoff = E.buf->cy;
+    }
+    if (E.buf->cy >= E.buf->rowoff + E.screenrows) {
+        E.buf->rowoff = E.buf->cy - E.screenrows + 1;
+    }
+    if (E.buf->rx < E.buf->coloff) {
+        E.buf->coloff = E.buf->rx;
     }
-    if (E.cy >= E.rowoff + E.screenrows) {
-        E.rowoff = E.cy - E.screenrows + 1;
+    if (E.buf->rx >= E.buf->coloff + E.screencols) {
+        E.buf->coloff = E.buf->rx - E.screencols + 1;
     }
-    if (E.rx < E.coloff) {
-        E.coloff = E.rx;
+}
+
+
+/*
+ * Append the part of a span of render that is visible from display
+ * column col on, up to width columns. at is the display column the span
+ * starts at and used the columns appended so far, both are carried over
+ * to the next span of the same row. ASCII spans are sliced directly,
+ * others are walked by grapheme cluster, padding wide characters cut by
+ * the edges.
+ */
+void editorDrawSpan(abuf *ab, const char *s, int len, int ascii, int col, int width, int *at, int *used) {
+    if (ascii) {
+        int from = col - *at;
+        if (from < 0) from = 0;
+        int n = len - from;
+        if (n > width - *used) n = width - *used;
+        if (n > 0) {
+            abAppend(ab, s + from, n);
+            *used += n;
+        }
+        *at += len;
+        return;
     }
-    if (E.rx >= E.coloff + E.screencols) {
-        E.coloff = E.rx - E.screencols + 1;
+
+    int j = 0;
+    while (j < len && *used < width) {
+        int w;
+        int end = editorClusterNext(s, len, j, &w);
+        if (*at >= col) {
+            if (*used + w > width) {
+                *used = width;
+                break;
+            }
+            abAppend(ab, s + j, end - j);
+            *used += w;
+        } else if (*at + w > col) {
+            abAppend(ab, " ", 1);
+            (*used)++;
+        }
+        *at += w;
+        j = end;
     }
 }
 
+/*
+ * Append the part of a row's render visible from display column col on,
+ * the row being typed into is drawn from both sides of its gap
+ */
+void editorDrawRender(abuf *ab, erow *row, int col, int width) {
+    int at = 0;
+    int used = 0;
+
+    if (E.gap.row != -1 && row == &E.buf->row[E.gap.row]) {
+        gapRow *g = &E.gap;
+        char *post = row->render + g->rgapend;
+        int len = g->rcap - g->rgapend;
+        editorDrawSpan(ab, row->render, g->rgap, row->ascii, col, width, &at, &used);
+        if (g->tabp >= 0) {
+            // The first tab after the gap is drawn as wide as it is now
+            char spaces[NI_TAB_STOP];
+            memset(spaces, ' ', g->tabw);
+            editorDrawSpan(ab, post, g->tabp, row->ascii, col, width, &at, &used);
+            editorDrawSpan(ab, spaces, g->tabw, 1, col, width, &at, &used);
+            post += g->tabp + g->tabr;
+            len -= g->tabp + g->tabr;
+        }
+        editorDrawSpan(ab, post, len, row->ascii, col, width, &at, &used);
+    } else {
+        editorDrawSpan(ab, row->render, row->rsize, row->ascii, col, width, &at, &used);
+    }
+}
 
 /*
  * Handle drawing each row of the text buffer being edited
  */
 void editorDrawRows(abuf *ab) {
     int y;
+    int filerow = E.buf->rowoff;
+    int sub = E.buf->rowoffsub; // Screen line within a wrapped row
     for (y=0; y < E.screenrows; y++) {
 
         // Vertical offset
-        int filerow = y + E.rowoff;
+        if (!E.wrap) filerow = y + E.buf->rowoff;
 
-        if (filerow >= E.numrows) {
+        if (filerow >= E.buf->numrows) {
             // print welcome screen if buffer is empty
-            if (E.numrows == 0 && y == E.screenrows / 3) {
+            if (E.buf->numrows == 0 && y == E.screenrows / 3) {
                 char welcome[80];
                 int welcomelen = snprintf(welcome, sizeof(welcome),
                         "Ni editor -- version %s", NI_VERSION);
@@ -463,10 +2832,16 @@ void editorDrawRows(abuf *ab) {
             }
 
         } else {
-            int len = E.row[filerow].rsize - E.coloff;
-            if (len < 0) len = 0;
-            if (len > E.screencols) len = E.screencols;
-            abAppend(ab, E.row[filerow].render + E.coloff, len);
+            // Render caches of long hidden buffers are rebuilt lazily
+            if (E.buf->row[filerow].render == NULL) editorUpdateRow(&E.buf->row[filerow]);
+
+            int off = E.wrap ? editorWrapLineStart(&E.buf->row[filerow], sub) : E.buf->coloff;
+            editorDrawRender(ab, &E.buf->row[filerow], off, E.screencols);
+
+            if (E.wrap && ++sub >= editorWrapLines(E.buf, filerow)) {
+                filerow++;
+                sub = 0;
+            }
         }
 
         // Clear line
@@ -499,8 +2874,11 @@ void editorDrawStatusBar(abuf *ab) {
     // Create status (left) and rstatus (right) messages
     char status[80], rstatus[80];
     char* mode = editorGetMode();
-    int len = snprintf(status, sizeof(status), " %.20s | %.20s | %d lines", mode, E.filename ? E.filename : "[No name]", E.numrows);
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d:%d ", E.cy + 1, E.cx + 1);
+    int len = snprintf(status, sizeof(status), " %.20s | %.20s | %d lines", mode, E.buf->filename ? E.buf->filename : "[No name]", E.buf->numrows);
+    if (E.recording >= 0) {
+        len += snprintf(status + len, sizeof(status) - len, " | recording @%c", 'a' + E.recording);
+    }
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%d:%d ", E.buf->cy + 1, E.buf->cx + 1);
 
     if (len > E.screencols) len = E.screencols;
 
@@ -548,28 +2926,87 @@ void editorDrawMessageBar(abuf *ab) {
 
 void editorRefreshScreen() {
     editorScroll();
-    abuf ab = ABUF_INIT;
+    // Macro replay draws a single frame once it is done
+    if (E.replaydepth > 0) return;
+
+    abuf *ab = &E.frame;
+    abReset(ab);
 
+    // Begin synchronized update, the terminal presents the frame at once
+    if (E.sync) abAppend(ab, "\x1b[?2026h", 8);
     // Hide cursor
-    abAppend(&ab, "\x1b[?25l", 6);
+    abAppend(ab, "\x1b[?25l", 6);
     // Reset cursor
-    abAppend(&ab, "\x1b[H", 3);
+    abAppend(ab, "\x1b[H", 3);
 
-    editorDrawRows(&ab);  // Draw editor buffer
-    editorDrawStatusBar(&ab); // Draw status line
-    editorDrawMessageBar(&ab); // Draw status message
+    editorDrawRows(ab);  // Draw editor buffer
+    editorDrawStatusBar(ab); // Draw status line
+    editorDrawMessageBar(ab); // Draw status message
 
     // Set cursor position
+    int cy = E.buf->cy - E.buf->rowoff;
+    int cx = E.buf->rx - E.buf->coloff;
+    if (E.wrap) {
+        cy = editorWrapLinesBetween(E.buf, E.buf->rowoff, E.buf->cy) - E.buf->rowoffsub + editorWrapCursorSub(&cx);
+    }
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy + 1 - E.rowoff, E.rx + 1 - E.coloff);
-    abAppend(&ab, buf, strlen(buf));
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy + 1, cx + 1);
+    abAppend(ab, buf, strlen(buf));
 
     // Show cursor
-    abAppend(&ab, "\x1b[?25h", 6);
+    abAppend(ab, "\x1b[?25h", 6);
+    // End synchronized update
+    if (E.sync) abAppend(ab, "\x1b[?2026l", 8);
+
+    // Write buffer in one go, only a short write needs another call
+    int off = 0;
+    while (off < ab->len) {
+        ssize_t n = write(STDOUT_FILENO, ab->b + off, ab->len - off);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        off += n;
+    }
+
+    E.framepending = 0;
+    clock_gettime(CLOCK_MONOTONIC, &E.lastframe);
+}
 
-    // Write buffer
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+long editorMsSinceFrame() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - E.lastframe.tv_sec) * 1000 + (now.tv_nsec - E.lastframe.tv_nsec) / 1000000;
+}
+
+/*
+ * Wait up to ms milliseconds for input, return whether there is some
+ */
+int editorInputPending(long ms) {
+    fd_set fds;
+    struct timeval tv;
+
+    FD_ZERO(&fds);
+    FD_SET(STDIN_FILENO, &fds);
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    return select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv) > 0;
+}
+
+/*
+ * Draw the pending frame when it is due. A frame is due once no input
+ * is waiting and the last one is at least 1/maxfps old. Input arriving
+ * first makes the frame stale, so it is skipped, unless the screen has
+ * gone NI_FRAME_MAX_DELAY without an update.
+ */
+void editorFlushFrame() {
+    if (!E.framepending) return;
+
+    long wait = E.maxfps > 0 ? 1000 / E.maxfps - editorMsSinceFrame() : 0;
+    if (wait < 0) wait = 0;
+    if (editorInputPending(wait) && editorMsSinceFrame() < NI_FRAME_MAX_DELAY) return;
+
+    editorRefreshScreen();
 }
 
 void editorSetStatusMsg(const char *fmt, ...) {
@@ -580,44 +3017,139 @@ void editorSetStatusMsg(const char *fmt, ...) {
     E.statusmsg_time = time(NULL);
 }
 
+/*** resize ***/
+
+void editorSigwinch(int sig) {
+    (void) sig;
+    E.resized = 1;
+}
+
+/*
+ * Pick up the new terminal size and repaint. Only the viewport is
+ * recomputed, editorScroll fixes up rowoff and coloff for the new size
+ * and the wrap index stays stale until the editor is idle, so a burst
+ * of resizes costs a screenful of work each.
+ */
+void editorHandleResize() {
+    int rows, cols;
+
+    E.resized = 0;
+    if (getWindowSize(&rows, &cols) == -1) return;
+
+    // Make room for the status bar and message, keep one row for text
+    rows -= 2;
+    if (rows < 1) rows = 1;
+    if (cols < 1) cols = 1;
+    if (rows == E.screenrows && cols == E.screencols) return;
+
+    E.screenrows = rows;
+    E.screencols = cols;
+    editorScroll();
+    E.framepending = 1;
+}
+
+/*
+ * Wait up to ms milliseconds for a key. SIGWINCH is only unblocked for
+ * the duration of the wait, so a resize can't arrive between checking
+ * E.resized and going to sleep. Returns 1 if a key is ready, 0 on timeout
+ * and -1 when woken up by a resize or search results.
+ */
+int editorWaitInput(long ms) {
+    fd_set fds;
+    struct timespec ts;
+    int maxfd = STDIN_FILENO;
+
+    FD_ZERO(&fds);
+    FD_SET(STDIN_FILENO, &fds);
+    if (E.search) {
+        FD_SET(E.search->pipe[0], &fds);
+        if (E.search->pipe[0] > maxfd) maxfd = E.search->pipe[0];
+    }
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000;
+
+    int n = pselect(maxfd + 1, &fds, NULL, NULL, &ts, &E.waitmask);
+    if (n == 0) return 0;
+    if (n > 0 && FD_ISSET(STDIN_FILENO, &fds)) return 1;
+    return -1;
+}
+
+/*
+ * Whether deferred work should give way, a key or a resize is waiting
+ */
+int editorIdleInterrupted() {
+    sigset_t pending;
+    if (sigpending(&pending) == 0 && sigismember(&pending, SIGWINCH)) return 1;
+    return editorInputPending(0);
+}
+
+/*
+ * Catch up on deferred work once no key arrived within the idle timeout.
+ * The wrap index is rebuilt in chunks and picked up where it was left
+ * when input arrives in between.
+ */
+void editorIdle() {
+    if (!E.wrap || editorWrapValid(E.buf)) return;
+    while (!editorWrapBuild(E.buf, NI_WRAP_CHUNK)) {
+        if (editorIdleInterrupted()) return;
+    }
+}
+
 /*** input ***/
 
 /*
  * Handle all cursor movement keys
  */
 void editorMoveCursor(int key) {
+    // Moving within the row being typed into takes the gap along,
+    // leaving it puts the row back into compact storage
+    if (E.gap.row != -1) {
+        if ((key == ARROW_LEFT || key == 'h') && E.buf->cx > 0) {
+            editorGapMove(-1);
+            return;
+        }
+        if ((key == ARROW_RIGHT || key == 'l') && E.buf->cx < E.buf->row[E.gap.row].size) {
+            editorGapMove(1);
+            return;
+        }
+        editorGapFlush();
+    }
+
     // Current row
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow *row = (E.buf->cy >= E.buf->numrows) ? NULL : &E.buf->row[E.buf->cy];
+    int vertical = 0;
 
     switch (key) {
         case 'k':
         case ARROW_UP:
-            if (E.cy != 0) {
-                E.cy--;
+            if (E.buf->cy != 0) {
+                E.buf->cy--;
             }
+            vertical = 1;
             break;
         case 'j':
         case ARROW_DOWN:
-            if (E.cy < E.numrows) {
-                E.cy++;
+            if (E.buf->cy < E.buf->numrows) {
+                E.buf->cy++;
             }
+            vertical = 1;
             break;
         case 'h':
         case ARROW_LEFT:
-            if (E.cx != 0) {
-                E.cx--;
-            } else if (E.cy > 0) {
-                E.cy--;
-                E.cx = E.row[E.cy].size;
+            if (E.buf->cx != 0) {
+                E.buf->cx = row->ascii ? E.buf->cx - 1 : editorClusterPrev(row->chars, row->size, E.buf->cx);
+            } else if (E.buf->cy > 0) {
+                E.buf->cy--;
+                E.buf->cx = E.buf->row[E.buf->cy].size;
             }
             break;
         case 'l':
         case ARROW_RIGHT:
-            if (row && E.cx < row->size) {
-                E.cx++;
-            } else if (row && E.cx == row->size) {
-                E.cy++;
-                E.cx = 0;
+            if (row && E.buf->cx < row->size) {
+                E.buf->cx = row->ascii ? E.buf->cx + 1 : editorClusterNext(row->chars, row->size, E.buf->cx, NULL);
+            } else if (row && E.buf->cx == row->size) {
+                E.buf->cy++;
+                E.buf->cx = 0;
             }
             break;
 
@@ -628,30 +3160,90 @@ void editorMoveCursor(int key) {
             if (row) {
                 if (key == 'W' || key == 'E') {
                     // Move pass all chars
-                    while (E.cx < row->size && !isspace(E.row[E.cy].chars[E.cx++])) {}
+                    while (E.buf->cx < row->size && !isspace((unsigned char) E.buf->row[E.buf->cy].chars[E.buf->cx++])) {}
                 } else { // w, e
                     // TODO: moving words while stopping at punctuations doesn't really work
-                    while (E.cx < row->size && !isspace(E.row[E.cy].chars[E.cx++]) && !ispunct(E.row[E.cy].chars[E.cx])) {}
+                    while (E.buf->cx < row->size && !isspace((unsigned char) E.buf->row[E.buf->cy].chars[E.buf->cx++]) && !ispunct((unsigned char) E.buf->row[E.buf->cy].chars[E.buf->cx])) {}
                 }
                 if (key == 'W' || key == 'w') {
                     // Move pass all spaces
-                    while (E.cx < row->size && E.row[E.cy].chars[E.cx] == ' ') E.cx++;
+                    while (E.buf->cx < row->size && E.buf->row[E.buf->cy].chars[E.buf->cx] == ' ') E.buf->cx++;
                 }
 
-                if (E.cx >= row->size) {
-                    E.cy++;
-                    E.cx = 0;
+                if (E.buf->cx >= row->size) {
+                    E.buf->cy++;
+                    E.buf->cx = 0;
                 }
 
             }
     }
 
     // Snap cursor to end of line
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = (E.buf->cy >= E.buf->numrows) ? NULL : &E.buf->row[E.buf->cy];
     int rowlen = row ? row->size : 0;
-    if (E.cx > rowlen) {
-        E.cx = rowlen;
+    if (E.buf->cx > rowlen) {
+        E.buf->cx = rowlen;
+    }
+
+    // Don't land inside a multi-byte character when changing rows
+    if (vertical && row) {
+        E.buf->cx = editorRowSnapCx(row, E.buf->cx);
+    }
+}
+
+/*** macro replay ***/
+
+void editorProcessKeypress();
+
+/*
+ * Start or stop recording keys into a register with q{reg}
+ */
+void editorMacroRecord() {
+    if (E.recording >= 0) {
+        // Drop the q that stopped the recording, unless it came from a
+        // replaying macro and was never recorded
+        if (E.replaydepth == 0) E.macros[E.recording].len--;
+        E.recording = -1;
+        return;
+    }
+
+    int reg = editorMacroReg(editorReadKey());
+    if (reg == -1) return;
+
+    E.macros[reg].len = 0;
+    E.recording = reg;
+}
+
+/*
+ * Replay a register count times with @{reg}, @@ replays the last one.
+ * Keys are fed straight into editorProcessKeypress without drawing,
+ * the main loop repaints once after the whole replay. The view is still
+ * scrolled after every key since commands like Ctrl-D start from rowoff.
+ */
+void editorMacroPlay(int count) {
+    int c = editorReadKey();
+    int reg = c == '@' ? E.lastmacro : editorMacroReg(c);
+    if (reg == -1) return;
+
+    if (E.replaydepth == NI_MACRO_DEPTH) {
+        editorSetStatusMsg("Macro recursion too deep");
+        return;
+    }
+
+    E.lastmacro = reg;
+    macroReplay *r = &E.replay[E.replaydepth++];
+    r->reg = reg;
+    r->len = E.macros[reg].len;
+
+    while (count--) {
+        r->pos = 0;
+        while (r->pos < r->len) {
+            editorProcessKeypress();
+            editorScroll();
+        }
     }
+
+    E.replaydepth--;
 }
 
 /*
@@ -680,6 +3272,24 @@ void editorProcessKeypress() {
                     editorSetStatusMsg(":");
                     break;
 
+                    // Macros
+                case 'q':
+                    editorMacroRecord();
+                    break;
+
+                case '@':
+                    {
+                        int count = E.cmdrep ? E.cmdrep : 1;
+                        E.cmdrep = 0;
+                        editorMacroPlay(count);
+                    }
+                    break;
+
+                    // Open the result under the cursor
+                case '\r':
+                    if (E.buf->kind != FILE_BUFFER) editorSearchPick();
+                    break;
+
                     // Easy quit command
                 case CTRL_KEY('q'): // Ctrl-Q to quit
                     editorExit();
@@ -688,14 +3298,14 @@ void editorProcessKeypress() {
                     // Beginning of line
                 case '0':
                 case HOME_KEY:
-                    E.cx = 0;
+                    E.buf->cx = 0;
                     break;
 
                     // End of line
                 case '$':
                 case END_KEY:
-                    if (E.cy < E.numrows) {
-                        E.cx = E.row[E.cy].size;
+                    if (E.buf->cy < E.buf->numrows) {
+                        E.buf->cx = E.buf->row[E.buf->cy].size;
                     }
                     break;
 
@@ -706,10 +3316,10 @@ void editorProcessKeypress() {
                     {
                         // Move cursor to top or bottom of screen
                         if (c == PAGE_UP || c == CTRL_KEY('u')) {
-                            E.cy = E.rowoff;
+                            E.buf->cy = E.buf->rowoff;
                         } else if (c == PAGE_DOWN || c == CTRL_KEY('d')) {
-                            E.cy = E.rowoff + E.screenrows - 1;
-                            if (E.cy > E.numrows) E.cy = E.numrows;
+                            E.buf->cy = E.buf->rowoff + E.screenrows - 1;
+                            if (E.buf->cy > E.buf->numrows) E.buf->cy = E.buf->numrows;
                         }
 
                         int times = E.screenrows;
@@ -743,6 +3353,7 @@ void editorProcessKeypress() {
     } else if (E.mode == INSERT_MODE) {
         switch (c) {
             case '\x1b': // Esc to return to normal mode
+                editorGapFlush();
                 E.mode = NORMAL_MODE;
                 break;
 
@@ -752,15 +3363,35 @@ void editorProcessKeypress() {
             case ARROW_RIGHT:
                 editorMoveCursor(c);
                 break;
+
+            case '\r':
+                editorInsertNewline();
+                break;
+
+            case 127: // Backspace key
+            case CTRL_KEY('h'):
+                editorDelChar();
+                break;
+
+            case DEL_KEY:
+                editorDelCharForward();
+                break;
+
+            default:
+                // Printable characters, tabs and UTF-8 bytes are typed in
+                if (c == '\t' || (c >= 32 && c < 256 && c != 127)) {
+                    editorInsertChar(c);
+                }
         }
     } else if (E.mode == COMMAND_MODE) {
         switch (c) {
             case 13: // Enter key executes command
+                // Clear status message first so commands can report back
+                editorSetStatusMsg("");
                 editorCommandModeHandle();
 
                 // Clear command buffer and return to normal mode
                 abFree(&E.cmdbuf); // free the command buffer
-                editorSetStatusMsg(""); // clear status message
                 E.mode = NORMAL_MODE;
                 break;
 
@@ -770,14 +3401,17 @@ void editorProcessKeypress() {
                 E.mode = NORMAL_MODE;
                 break;
 
-            case '8': // Delete key
+            case 127: // Backspace key
+            case CTRL_KEY('h'):
                 abDelete(&E.cmdbuf, 1);
+                editorSetStatusMsg(":%.*s", E.cmdbuf.len, E.cmdbuf.b);
                 break;
 
             default: // Append characters to E.cmdbuf
                 if (isprint(c)) {
-                    abAppend(&E.cmdbuf, (char *) &c, 1);
-                    editorSetStatusMsg(":%s", E.cmdbuf.b);
+                    char ch = c;
+                    abAppend(&E.cmdbuf, &ch, 1);
+                    editorSetStatusMsg(":%.*s", E.cmdbuf.len, E.cmdbuf.b);
                 }
         }
 
@@ -795,16 +3429,41 @@ void initEditor() {
     E.mode = NORMAL_MODE;
     E.cmdbuf.b = NULL;
     E.cmdbuf.len = 0;
-    E.cx = 0;
-    E.cy = 0;
-    E.rx = 0;
-    E.rowoff = 0;
-    E.coloff = 0;
-    E.numrows = 0;
-    E.row = NULL;
+    E.cmdbuf.cap = 0;
+    E.buffers = NULL;
+    E.numbufs = 0;
+    E.renderbytes = 0;
+    E.wrap = 0;
+    E.gap.row = -1;
+    E.search = NULL;
+    E.frame.b = NULL;
+    E.frame.len = 0;
+    E.frame.cap = 0;
+    E.framepending = 1;
+    E.lastframe.tv_sec = 0;
+    E.lastframe.tv_nsec = 0;
+    E.maxfps = NI_MAX_FPS;
+    E.sync = 1;
+    E.buf = editorNewBuffer();
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
-    E.filename = NULL;
+    E.recording = -1;
+    E.lastmacro = -1;
+    E.replaydepth = 0;
+    E.resized = 0;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = editorSigwinch;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+
+    // SIGWINCH is only let through while waiting for input
+    sigset_t winch;
+    sigemptyset(&winch);
+    sigaddset(&winch, SIGWINCH);
+    if (pthread_sigmask(SIG_BLOCK, &winch, &E.waitmask) != 0) die("pthread_sigmask");
+    sigdelset(&E.waitmask, SIGWINCH);
 
     if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
     // Make room for a 1 line status bar and 1 line message
@@ -815,14 +3474,17 @@ int main(int argc, char **argv) {
     enableRawMode();
     initEditor();
     if (argc >= 2) {
-        editorOpen(argv[1]);
+        if (editorOpen(E.buf, argv[1]) == -1) die("fopen");
     }
 
     editorSetStatusMsg("Welcome");
 
     while (1) {
-        editorRefreshScreen();
+        // The frame is drawn once the input has been caught up with, but
+        // the view follows every key since commands start from rowoff
+        E.framepending = 1;
         editorProcessKeypress();
+        editorScroll();
     };
 
     return 0;